@@ -1,7 +1,9 @@
 #include <iostream>
+#include <map>
 #include <memory.h>
 #include "Parser/Program.hpp"
 #include "CodeGen/TinyVMCode.hpp"
+#include "CodeGen/TinyVMRegisterCode.hpp"
 #include "CodeGen/CCode.hpp"
 #include "flags.h"
 extern "C"
@@ -12,37 +14,258 @@ extern "C"
 }
 using namespace TinyScript;
 
+// Compiled files are mapped into memory where there's mmap
+#if defined(__unix__) || defined(__APPLE__)
+#define MAP_BIN 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define MAP_BIN 0
+#endif
+
+static int stack_size = STACK_MEMORY;
+static string counts_path = "";
+static int fuel = 0;
+static int stack_limit = 0;
+
 void import_std(NodeProgram &prog)
 {
     prog.add_src("../std/io.tiny");
 }
 
-int run_bin(string path)
+void print_tier_stats(VMContext *context)
 {
+    static const char *tier_names[] = { "decoded", "fused", "native" };
+    const VMTierStats *stats = vm_tier_stats(context);
+
+    printf("\nTier thresholds: fuse %i, jit %i\n",
+        stats->fuse_threshold, stats->jit_threshold);
+    printf("Functions:\n");
+    for (int i = 0; i < stats->function_count; i++)
+    {
+        const VMFunctionStats &function = stats->functions[i];
+        printf("  %6i  %10llu calls  %10llu back-edges  %s\n", function.offset,
+            function.calls, function.back_edges, tier_names[function.tier]);
+    }
+
+    printf("Promotions:\n");
+    for (int i = 0; i < stats->promotion_count; i++)
+    {
+        const VMPromotion &promotion = stats->promotions[i];
+        printf("  %6i  to %-7s at %llu calls, %llu back-edges\n", promotion.offset,
+            tier_names[promotion.tier], promotion.calls, promotion.back_edges);
+    }
+}
+
+// Write each distinct call chain sampled, outermost frame first, with 
+// how many times it was seen. This is the collapsed stack format flame 
+// graph tools read. Code without a debug section only has offsets
+void write_profile(VMScript *script, VMContext *context, string path)
+{
+    const VMProfileStats *stats = vm_profile_stats(context);
+    std::map<string, int> chains;
+    for (int i = 0; i < stats->sample_count; i++)
+    {
+        const VMSample &sample = stats->samples[i];
+        string chain;
+        for (int j = sample.depth - 1; j >= 0; j--)
+        {
+            VMSourcePosition position;
+            int offset = sample.offsets[j];
+            if (vm_find_source(script, offset, &position) == 0)
+                chain += string(position.function) + ":" + std::to_string(position.line);
+            else
+                chain += "@" + std::to_string(offset);
+            if (j > 0)
+                chain += ";";
+        }
+        chains[chain] += 1;
+    }
+
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == NULL)
+    {
+        Logger::link_error("Could not write profile to '" + path + "'");
+        return;
+    }
+
+    for (auto chain : chains)
+        fprintf(file, "%s %i\n", chain.first.c_str(), chain.second);
+    fclose(file);
+
+    printf("\nProfile: %i samples at %i Hz written to '%s'", 
+        stats->sample_count, stats->frequency, path.c_str());
+    if (stats->dropped > 0)
+        printf(", %i dropped", stats->dropped);
+    printf("\n");
+}
+
+int run_code(const char *code, int size, bool tier_stats, string profile)
+{
+    VMContext *context = vm_create(stack_size);
+    if (context == NULL)
+        return 1;
+
+    register_std(context);
+    vm_set_fuel(context, fuel, 0);
+    vm_set_stack_limit(context, stack_limit);
+    VMScript *script = vm_load(context, code, size);
+    if (script == NULL || 
+        (profile != "" && vm_profile_start(context, VM_PROFILE_RATE)))
+    {
+        if (script != NULL)
+            vm_unload(script);
+        vm_free(context);
+        return 1;
+    }
+
+    if (counts_path != "")
+        vm_counts_start(context, NULL);
+
+    int error = vm_call(script, vm_entry(script), NULL);
+    if (counts_path != "")
+    {
+        vm_counts_stop(context);
+        if (!vm_counts_write(context, counts_path.c_str()))
+            printf("\nCounts written to '%s'\n", counts_path.c_str());
+    }
+
+    if (profile != "")
+    {
+        vm_profile_stop(context);
+        write_profile(script, context, profile);
+    }
+
+    vm_unload(script);
+    if (!error && tier_stats)
+        print_tier_stats(context);
+
+    vm_free(context);
+    return error ? 1 : 0;
+}
+
+// Compiled code is mapped rather than read in, so it's used straight 
+// from the page cache, which every process running the same file shares
+int run_bin(string path, bool tier_stats, string profile)
+{
+#if MAP_BIN
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1)
+    {
+        Logger::link_error("Could not open '" + path + "'");
+        if (fd != -1)
+            close(fd);
+        return 1;
+    }
+
+    size_t len = info.st_size;
+    void *data = len > 0 ? 
+        mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        Logger::link_error("Could not map '" + path + "'");
+        return 1;
+    }
+
+    int error = run_code((const char*)data, len, tier_stats, profile);
+    munmap(data, len);
+    return error;
+#else
     FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+    {
+        Logger::link_error("Could not open '" + path + "'");
+        return 1;
+    }
+
     fseek(file, 0L, SEEK_END);
-    int len = ftell(file);
+    long len = ftell(file);
     rewind(file);
 
-    int main_func;
-    char *code = (char*)malloc(len - sizeof(int));
-    fread(&main_func, 1, sizeof(int), file);
-    fread(code, 1, len - sizeof(int), file);
+    char *code = len > 0 ? (char*)malloc(len) : NULL;
+    if (code == NULL || fread(code, 1, len, file) != (size_t)len)
+    {
+        Logger::link_error("Could not read '" + path + "'");
+        free(code);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
 
-    vm_init();
-    register_std();
-    vm_run(code, main_func, NULL);
+    int error = run_code(code, len, tier_stats, profile);
     free(code);
+    return error;
+#endif
+}
+
+// Compile to TinyVM code, starting from the main function of the first 
+// module given. Gives false if there were errors
+bool compile_vm(NodeProgram &prog, bool registers, vector<char> &bytecode)
+{
+    TinyVM::Code stack_code;
+    TinyVM::RegisterCode register_code;
+    TinyVM::Code &code = registers ? register_code : stack_code;
+    code.compile_program(prog);
+
+    NodeModule *mod = (NodeModule*)prog[0];
+    code.set_entry(mod->get_name().data + ".main");
+    bytecode = code.link(true);
+    if (Logger::has_error())
+        return false;
 
+#if DEBUG_ASSEMBLY
+    printf("\nDisassembly: ");
+    disassemble(&bytecode[0], bytecode.size());
+    printf("\n");
+#endif
+
+    return true;
+}
+
+int run_program(NodeProgram &prog, bool registers, bool tier_stats, 
+    string profile)
+{
+    vector<char> bytecode;
+    if (!compile_vm(prog, registers, bytecode))
+        return 1;
+
+    return run_code(&bytecode[0], bytecode.size(), tier_stats, profile);
+}
+
+// The linked code names its entry function, so it's written as it is
+int write_bin(NodeProgram &prog, bool registers, string path)
+{
+    vector<char> bytecode;
+    if (!compile_vm(prog, registers, bytecode))
+        return 1;
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL ||
+        fwrite(&bytecode[0], 1, bytecode.size(), file) != bytecode.size())
+    {
+        Logger::link_error("Could not write '" + path + "'");
+        if (file != NULL)
+            fclose(file);
+        return 1;
+    }
+
+    fclose(file);
     return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    C::Code code("c_code");
     NodeProgram prog;
     string output = "";
     string bin = "";
+    bool run = false;
+    bool registers = false;
+    bool tier_stats = false;
+    string profile = "";
     //import_std(prog);
 
     // Include all files parsed into compiler
@@ -61,7 +284,54 @@ int main(int argc, char *argv[])
             if (i >= argc - 1)
                 Logger::link_error("Expected bin file");
             else
-                return run_bin(argv[++i]);
+                bin = argv[++i];
+        }
+        else if (arg == "-r" || arg == "--run")
+        {
+            run = true;
+        }
+        else if (arg == "--registers")
+        {
+            registers = true;
+        }
+        else if (arg == "--tier-stats")
+        {
+            tier_stats = true;
+        }
+        else if (arg == "--profile")
+        {
+            if (i >= argc - 1)
+                Logger::link_error("Expected profile file");
+            else
+                profile = argv[++i];
+        }
+        else if (arg == "--counts")
+        {
+            if (i >= argc - 1)
+                Logger::link_error("Expected counts file");
+            else
+                counts_path = argv[++i];
+        }
+        else if (arg == "--stack-size")
+        {
+            if (i >= argc - 1)
+                Logger::link_error("Expected stack size");
+            else
+                stack_size = atoi(argv[++i]);
+        }
+        else if (arg == "--fuel")
+        {
+            if (i >= argc - 1)
+                Logger::link_error("Expected fuel");
+            else
+                fuel = atoi(argv[++i]);
+        }
+        else if (arg == "--stack-limit")
+        {
+            if (i >= argc - 1)
+                Logger::link_error("Expected stack limit");
+            else
+                stack_limit = atoi(argv[++i]);
         }
         else
         {
@@ -69,37 +339,15 @@ int main(int argc, char *argv[])
         }
     }
 
-    prog.parse();
-    code.compile_program(prog);
-/*
-    vector<char> bytecode = code.link();
-    int main_func = code.find_funcion("test.main");
-
-    char *raw_code = (char*)malloc(bytecode.size());
-    memcpy(raw_code, &bytecode[0], bytecode.size());
-
-#if DEBUG_ASSEMBLY
-        printf("\nDisassembly: ");
-        disassemble(raw_code, bytecode.size());
-        printf("\n");
-#endif
-
-    if (!Logger::has_error())
-    {
-        if (output != "")
-        {
-            FILE *file = fopen(output.c_str(), "wb");
-            fwrite(&main_func, 1, sizeof(int), file);
-            fwrite(raw_code, 1, bytecode.size(), file);
-            fclose(file);
-            return 0;
-        }
+    if (bin != "")
+        return run_bin(bin, tier_stats, profile);
 
-        vm_init();
-        register_std();
-        vm_run(raw_code, main_func, NULL);
-    }
+    prog.parse();
+    if (output != "")
+        return write_bin(prog, registers, output);
+    if (run)
+        return run_program(prog, registers, tier_stats, profile);
 
-    free(raw_code);
-     */
+    C::Code code("c_code");
+    code.compile_program(prog);
 }
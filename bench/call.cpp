@@ -0,0 +1,100 @@
+#include <chrono>
+#include <cstdio>
+#include "Parser/Program.hpp"
+#include "CodeGen/TinyVMCode.hpp"
+#include "flags.h"
+#include "function.hpp"
+extern "C"
+{
+#include "vm.h"
+#include "std.h"
+}
+using namespace TinyScript;
+using Clock = std::chrono::steady_clock;
+
+// Time many calls of a small script's main function, both loading it
+// fresh for each call with vm_run and loading it once and reusing it,
+// then calls with args to a function found by name, pushing them one at 
+// a time, through a typed Function and as rows of a batch
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "bench/call.tiny";
+    int count = argc > 2 ? atoi(argv[2]) : 100000;
+
+    NodeProgram prog;
+    prog.add_src(path);
+    prog.parse();
+
+    TinyVM::Code code;
+    code.compile_program(prog);
+    vector<char> bytecode = code.link();
+    NodeModule *mod = (NodeModule*)prog[0];
+    int main_func = code.find_funcion(mod->get_name().data + ".main");
+    if (Logger::has_error())
+        return 1;
+
+    VMContext *context = vm_create(STACK_MEMORY);
+    register_std(context);
+
+    int result = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < count; i++)
+        vm_run(context, &bytecode[0], bytecode.size(), main_func, (char*)&result);
+    double run_ns = std::chrono::duration<double, std::nano>(
+        Clock::now() - start).count() / count;
+    printf("vm_run:  %8.0f ns per call (result %i)\n", run_ns, result);
+
+    result = 0;
+    VMScript *script = vm_load(context, &bytecode[0], bytecode.size());
+    start = Clock::now();
+    for (int i = 0; i < count; i++)
+        vm_call(script, main_func, (char*)&result);
+    double call_ns = std::chrono::duration<double, std::nano>(
+        Clock::now() - start).count() / count;
+    printf("vm_call: %8.0f ns per call (result %i)\n", call_ns, result);
+
+    const VMFunction *add = vm_get_function(script, 
+        (mod->get_name().data + ".add(int, int)").c_str());
+    if (add == NULL)
+        return 1;
+
+    result = 0;
+    start = Clock::now();
+    for (int i = 0; i < count; i++)
+    {
+        vm_begin_call(script, add);
+        vm_push_int(script, result);
+        vm_push_int(script, 1);
+        vm_invoke(script, (char*)&result);
+    }
+    double invoke_ns = std::chrono::duration<double, std::nano>(
+        Clock::now() - start).count() / count;
+    printf("vm_invoke: %6.0f ns per call (result %i)\n", invoke_ns, result);
+
+    TinyVM::Function<int(int, int)> typed(script, 
+        mod->get_name().data + ".add");
+    if (!typed.is_bound())
+        return 1;
+
+    result = 0;
+    start = Clock::now();
+    for (int i = 0; i < count; i++)
+        result = typed(result, 1);
+    double typed_ns = std::chrono::duration<double, std::nano>(
+        Clock::now() - start).count() / count;
+    printf("Function:  %6.0f ns per call (result %i)\n", typed_ns, result);
+
+    vector<int> left(count), right(count, 1), results(count);
+    for (int i = 0; i < count; i++)
+        left[i] = i;
+    start = Clock::now();
+    typed.batch(count, &results[0], &left[0], &right[0]);
+    double batch_ns = std::chrono::duration<double, std::nano>(
+        Clock::now() - start).count() / count;
+    printf("batch:     %6.0f ns per row (result %i)\n", batch_ns, 
+        results[count - 1]);
+
+    vm_unload(script);
+    vm_free(context);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include "Parser/Program.hpp"
+#include "CodeGen/TinyVMCode.hpp"
+#include "flags.h"
+extern "C"
+{
+#include "vm.h"
+#include "std.h"
+#include "scheduler.h"
+}
+using namespace TinyScript;
+using Clock = std::chrono::steady_clock;
+
+struct Script
+{
+    vector<char> bytecode;
+    int main_func;
+};
+
+static bool compile(const char *path, Script &script)
+{
+    NodeProgram prog;
+    prog.add_src(path);
+    prog.parse();
+
+    TinyVM::Code code;
+    code.compile_program(prog);
+    script.bytecode = code.link();
+    NodeModule *mod = (NodeModule*)prog[0];
+    script.main_func = code.find_funcion(mod->get_name().data + ".main");
+    return !Logger::has_error();
+}
+
+// Submit the corpus round robin as many small tasks, then await them all,
+// doubling the number of workers each time up to the most given
+int main(int argc, char *argv[])
+{
+    int max_workers = argc > 1 ? atoi(argv[1]) :
+        std::max(1, (int)std::thread::hardware_concurrency());
+    int count = argc > 2 ? atoi(argv[2]) : 20000;
+
+    vector<const char*> paths;
+    for (int i = 3; i < argc; i++)
+        paths.push_back(argv[i]);
+    if (paths.empty())
+    {
+        paths = { "bench/corpus/fib.tiny", "bench/corpus/primes.tiny",
+            "bench/corpus/sum.tiny" };
+    }
+
+    vector<Script> scripts(paths.size());
+    for (size_t i = 0; i < paths.size(); i++)
+        if (!compile(paths[i], scripts[i]))
+            return 1;
+
+    vector<VMTask*> tasks(count);
+    vector<int> results(count);
+    double base = 0;
+    for (int workers = 1; workers <= max_workers; workers *= 2)
+    {
+        VMScheduler *scheduler = scheduler_create(workers, STACK_MEMORY,
+            register_std);
+        if (scheduler == NULL)
+            return 1;
+
+        int errors = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < count; i++)
+        {
+            Script &script = scripts[i % scripts.size()];
+            tasks[i] = scheduler_submit(scheduler, &script.bytecode[0],
+                script.bytecode.size(), script.main_func, (char*)&results[i]);
+        }
+        for (int i = 0; i < count; i++)
+            errors += scheduler_await(tasks[i]) != VM_DONE;
+        double seconds = std::chrono::duration<double>(
+            Clock::now() - start).count();
+        scheduler_free(scheduler);
+
+        double rate = count / seconds;
+        if (workers == 1)
+            base = rate;
+        printf("%3i workers: %9.0f tasks/s  %5.2fx", workers, rate, rate / base);
+        if (errors > 0)
+            printf("  %i failed", errors);
+        printf("\n");
+    }
+
+    for (size_t i = 0; i < scripts.size(); i++)
+        printf("%s gave %i\n", paths[i], results[i]);
+    return 0;
+}
@@ -47,6 +47,7 @@ namespace TinyScript::C
         string compile_operation(ExpressionData &data, ExpDataNode *node);
         string compile_name(ExpressionData &data, ExpDataNode *node);
         string compile_array(ExpressionData &data, ExpDataNode *node);
+        string compile_new(ExpressionData &data, ExpDataNode *node);
 
         string project_dir;
         std::ofstream curr_file;
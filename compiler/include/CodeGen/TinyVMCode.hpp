@@ -14,17 +14,24 @@ namespace TinyScript::TinyVM
     {
     public:
         Code() {}
+        virtual ~Code() {}
 
-        vector<char> link();
+        // The debug section maps code offsets back to their function and 
+        // source position, without it the VM can only give offsets
+        vector<char> link(bool debug = false);
+
+        // The function the linked code says to start from
+        void set_entry(string label);
 
         // Code gen functions
         void write_byte(char b);
         void write_int(int i);
         void write_float(float f);
-        void write_string(string str);
+        void write_constant(string str);
         void write_label(string label);
         void assign_label(string label);
         int find_funcion(string name);
+        int find_external(const Symbol &symb);
         string gen_label();
 
         // Compile nodes
@@ -32,12 +39,12 @@ namespace TinyScript::TinyVM
         void compile_lexpression(NodeExpression *node);
         void compile_function(NodeFunction *node);
         void compile_block(NodeBlock *node);
-        void compile_let(NodeLet *node);
-        void compile_assign(NodeAssign *node);
+        virtual void compile_let(NodeLet *node);
+        virtual void compile_assign(NodeAssign *node);
         void compile_return(NodeReturn *node);
-        void compile_if(NodeIf *node);
-        void compile_for(NodeFor *node);
-        void compile_while(NodeWhile *node);
+        virtual void compile_if(NodeIf *node);
+        virtual void compile_for(NodeFor *node);
+        virtual void compile_while(NodeWhile *node);
         void compile_import(NodeImport *node);
         void compile_import_from(NodeImportFrom *node);
         void compile_external(NodeExtern *node);
@@ -45,16 +52,39 @@ namespace TinyScript::TinyVM
         void compile_module(NodeModule *node);
         void compile_program(NodeProgram &node);
 
-    private:
+    protected:
+
+        // Gives the final size of a function's frame once its body is compiled
+        virtual int finish_frame(int scope_size) { return scope_size; }
+
+        // Code written after this is from the given source position
+        void mark_line(const DebugInfo &debug_info);
+        void mark_statement(Node *node);
+        vector<char> link_imports() const;
+        vector<char> link_exports() const;
+        vector<char> link_debug() const;
+
+        // Locals use the smallest form that fits their size and offset
+        void write_load_local(int size, int location);
+        void write_store_local(int size, int location);
+        void write_local_ref(int location);
+
+        // Sizes that don't fit in a signed byte use the wide form
+        void write_pop(int size);
+        void write_alloc(int size);
+        void write_copy(int size);
+        void write_return(int size, int arg_size);
 
         // Expression
         Symbol find_lvalue_location(ExpDataNode *node);
         bool is_static_lvalue(ExpDataNode *node);
+        int find_operation(Token op, DataType ltype, DataType rtype, string form = "");
         void compile_operation(Token op, DataType ltype, DataType rtype);
         void compile_call(const Symbol &symb, ExpDataNode *node);
         void compile_rname(ExpDataNode *node);
         void compile_ref(ExpDataNode *node);
         void compile_copy(ExpDataNode *node);
+        void compile_new(ExpDataNode *node);
         void compile_array(ExpDataNode *node);
         void compile_cast(ExpDataNode *node);
         void compile_rterm(ExpDataNode *node);
@@ -66,7 +96,7 @@ namespace TinyScript::TinyVM
         void compile_typesize(ExpDataNode *node);
         void compile_typename(ExpDataNode *node);
         void compile_arraysize(ExpDataNode *node);
-        void compile_rvalue(ExpDataNode *node);
+        virtual void compile_rvalue(ExpDataNode *node);
         void compile_lvalue(ExpDataNode *node);
 
         // Code data
@@ -74,6 +104,17 @@ namespace TinyScript::TinyVM
         vector<Symbol> externals;
         map<string, tuple<vector<int>, int>> labels;
         vector<int> used_labels;
+        string entry;
+
+        // Constants are pooled, and the same one is only written once
+        vector<char> constants;
+        map<string, int> constant_offsets;
+
+        // In the order they were written, functions as their start and
+        // end offsets, name and return type, and lines as the offset they
+        // start at
+        vector<tuple<int, int, string, string>> functions;
+        vector<tuple<int, DebugInfo>> lines;
 
     };
 
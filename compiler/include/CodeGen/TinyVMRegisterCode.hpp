@@ -0,0 +1,51 @@
+#pragma once
+#include "CodeGen/TinyVMCode.hpp"
+
+namespace TinyScript::TinyVM
+{
+
+    // Generates the register form of TinyVM code, where operations name
+    // their frame slots directly instead of going through the stack.
+    // Temporaries get slots after the function's locals. Anything without
+    // a register form, like calls, arrays and attributes, uses the stack code
+    class RegisterCode : public Code
+    {
+    public:
+        RegisterCode() :
+            temp_size(0), max_temp_size(0) {}
+
+        virtual void compile_let(NodeLet *node);
+        virtual void compile_assign(NodeAssign *node);
+        virtual void compile_if(NodeIf *node);
+        virtual void compile_for(NodeFor *node);
+        virtual void compile_while(NodeWhile *node);
+
+    protected:
+        virtual int finish_frame(int scope_size);
+        virtual void compile_rvalue(ExpDataNode *node);
+
+    private:
+        struct Register
+        {
+            int location;
+            bool is_temp;
+        };
+
+        bool is_register_local(ExpDataNode *node);
+        bool is_constant(ExpDataNode *node);
+        bool is_register_value(ExpDataNode *node);
+        Register alloc_temp(int size);
+        void write_register(Register reg);
+
+        void compile_constant(ExpDataNode *node, Register dest);
+        Register compile_register(ExpDataNode *node, const Register *dest = nullptr);
+        void compile_condition(NodeExpression *node, string end);
+
+        // Temps are allocated from 0, and the operands are patched to sit
+        // after the locals once the frame size is known
+        int temp_size, max_temp_size;
+        vector<int> temp_operands;
+
+    };
+
+}
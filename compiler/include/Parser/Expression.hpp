@@ -62,6 +62,7 @@ namespace TinyScript
         void parse_array(Tokenizer &tk, ExpDataNode *node);
         void parse_ref(Tokenizer &tk, ExpDataNode *node);
         void parse_copy(Tokenizer &tk, ExpDataNode *node);
+        void parse_new(Tokenizer &tk, ExpDataNode *node);
         void parse_negate(Tokenizer &tk, ExpDataNode *node);
         void parse_name(Tokenizer &tk, ExpDataNode *node);
         void parse_args(Tokenizer &tk, ExpDataNode *node);
@@ -80,6 +81,7 @@ namespace TinyScript
         void symbolize_module_attr(ExpDataNode *node, const Symbol &left_symb);
         void symbolize_ref(ExpDataNode *node);
         void symbolize_copy(ExpDataNode *node);
+        void symbolize_new(ExpDataNode *node);
         void symbolize_typesize(ExpDataNode *node);
         void symbolize_typename(ExpDataNode *node);
         void symbolize_arraysize(ExpDataNode *node);
@@ -38,6 +38,7 @@ namespace TinyScript
         Ref,
         Array,
         Copy,
+        New,
 
         // Scope definers
         OpenBlock,
@@ -99,12 +99,14 @@ string Code::compile_local_type(DataType type, string name)
 
 string Code::compile_param_type(DataType type)
 {
+    // Refs are plain pointers in C, so views of host memory are just 
+    // the host's own pointers and need nothing else
     if (type.flags & DATATYPE_REF)
-        return compile_param_type(type) + "*";
+        return compile_param_type(*type.sub_type) + "*";
     
     if (type.flags & DATATYPE_ARRAY)
     {
-        return compile_param_type(type) + 
+        return compile_param_type(*type.sub_type) + 
             "[" + std::to_string(type.array_size) + "]";
     }
 
@@ -63,6 +63,19 @@ string Code::compile_array(ExpressionData &data, ExpDataNode *node)
     return out + "}";
 }
 
+string Code::compile_new(ExpressionData &data, ExpDataNode *node)
+{
+    // There's no region to free all at once in C, so these last until
+    // the program ends. Like the VM's, they start zeroed
+    string count = "1";
+    if (node->left != nullptr)
+        count = compile_expresion_node(data, node->left);
+    string type = compile_local_type(*node->type.sub_type, "");
+    type.erase(type.find_last_not_of(' ') + 1);
+    return "(" + compile_param_type(node->type) + ")calloc(" + count + 
+        ", sizeof(" + type + "))";
+}
+
 string Code::compile_rterm(ExpressionData &data, ExpDataNode *node)
 {
     string value = node->token.data;
@@ -77,6 +90,7 @@ string Code::compile_rterm(ExpressionData &data, ExpDataNode *node)
         case TokenType::OpenIndex: return compile_array(data, node);
         case TokenType::Ref: return "&" + compile_expresion_node(data, node->left);
         case TokenType::Copy: return "*" + compile_expresion_node(data, node->left);
+        case TokenType::New: return compile_new(data, node);
     }
 
     return "error";
@@ -11,7 +11,8 @@ void Code::compile_module(NodeModule *node)
     // Start a new file for the module
     string name = node->get_name().data;
     start_file(name);
-    write_line("#include \"" + name + ".h\"\n");
+    write_line("#include \"" + name + ".h\"");
+    write_line("#include <stdlib.h>\n");
 
     // Compile function headers
     for (Symbol symb : node->lookup_all())
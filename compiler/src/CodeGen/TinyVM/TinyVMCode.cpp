@@ -1,10 +1,24 @@
 #include "CodeGen/TinyVMCode.hpp"
 #include "memory.h"
 #include "flags.h"
+extern "C"
+{
+#include "bytecode.h"
+#include "format.h"
+}
 #include <algorithm>
 using namespace TinyScript::TinyVM;
+using namespace TinyScript;
+
+static void append_int(vector<char> &out, int value)
+{
+    int start = out.size();
+    out.resize(start + sizeof(int));
+    memcpy(&out[start], &value, sizeof(int));
+}
 
-vector<char> Code::link()
+// Lays the code out in sections as format.h describes
+vector<char> Code::link(bool debug)
 {
     vector<char> code_out = code;
     for (auto label : labels)
@@ -23,23 +37,176 @@ vector<char> Code::link()
             memcpy(&code_out[addr], &location, sizeof(int));
     }
 
-    vector<char> header;
-    header.push_back(externals.size());
-    for (Symbol symb : externals)
+    int entry_offset = -1;
+    if (entry != "")
+        entry_offset = find_funcion(entry);
+
+    vector<tuple<int, vector<char>>> sections;
+    sections.push_back(std::make_tuple(VM_SECTION_IMPORTS, link_imports()));
+    sections.push_back(std::make_tuple(VM_SECTION_EXPORTS, link_exports()));
+    sections.push_back(std::make_tuple(VM_SECTION_CONSTANTS, constants));
+    if (debug)
+        sections.push_back(std::make_tuple(VM_SECTION_DEBUG, link_debug()));
+    sections.push_back(std::make_tuple(VM_SECTION_CODE, code_out));
+
+    vector<char> out(VM_FORMAT_MAGIC, VM_FORMAT_MAGIC + 4);
+    append_int(out, VM_FORMAT_VERSION);
+    append_int(out, entry_offset);
+    append_int(out, sections.size());
+
+    // Sections follow the directory in the same order, each padded 
+    // out to start 4 byte aligned
+    int offset = out.size() + sections.size() * 12;
+    for (auto section : sections)
+    {
+        int size = std::get<1>(section).size();
+        append_int(out, std::get<0>(section));
+        append_int(out, offset);
+        append_int(out, size);
+        offset += (size + 3) & ~3;
+    }
+
+    for (auto section : sections)
+    {
+        const vector<char> &data = std::get<1>(section);
+        out.insert(out.end(), data.begin(), data.end());
+        out.resize((out.size() + 3) & ~3);
+    }
+
+    return out;
+}
+
+void Code::set_entry(string label)
+{
+    entry = label;
+}
+
+static void append_name(vector<char> &out, const string &name)
+{
+    append_int(out, name.length());
+    out.insert(out.end(), name.begin(), name.end());
+}
+
+// Each external gives the size of its args, as it pops them itself 
+// and the VM needs to know how far that moves the stack. Its slot is 
+// its place in the table
+vector<char> Code::link_imports() const
+{
+    vector<char> out;
+    append_int(out, externals.size());
+    for (const Symbol &external : externals)
+    {
+        int arg_size = 0;
+        for (const DataType &param : external.params)
+            arg_size += DataType::find_size(param);
+
+        append_int(out, arg_size);
+        append_name(out, Symbol::printout(external));
+    }
+
+    return out;
+}
+
+// Every function compiled, sorted by name, with its return type so a 
+// host can check it before calling
+vector<char> Code::link_exports() const
+{
+    auto sorted = functions;
+    std::sort(sorted.begin(), sorted.end(), 
+        [](const tuple<int, int, string, string> &a, 
+            const tuple<int, int, string, string> &b)
+        {
+            return std::get<2>(a) < std::get<2>(b);
+        });
+
+    vector<char> out;
+    append_int(out, sorted.size());
+    for (auto function : sorted)
+    {
+        append_int(out, std::get<0>(function));
+        append_name(out, std::get<2>(function));
+        append_name(out, std::get<3>(function));
+    }
+
+    return out;
+}
+
+static void write_uleb(vector<char> &out, unsigned int value)
+{
+    do
     {
-        string name = Symbol::printout(symb);
-        int id = symb.location;
+        char byte = value & 0x7F;
+        value >>= 7;
+        out.push_back(value ? byte | 0x80 : byte);
+    } while (value);
+}
 
-        int start = header.size();
-        header.resize(start + 4 + 1 + name.length());
-        memcpy(&header[start], &id, sizeof(int));
-        memcpy(&header[start + 5], name.c_str(), name.length());
-        header[start + 4] = name.length();
+static void write_sleb(vector<char> &out, int value)
+{
+    bool more = true;
+    while (more)
+    {
+        char byte = value & 0x7F;
+        value >>= 7;
+        more = !((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)));
+        out.push_back(more ? byte | 0x80 : byte);
     }
+}
+
+static void write_name(vector<char> &out, const string &name)
+{
+    write_uleb(out, name.length());
+    out.insert(out.end(), name.begin(), name.end());
+}
 
+// A version byte, then the source files, the functions as the gap 
+// before each one and its length, and the line table. Each line row 
+// is the offset since the last row, its file, the change in line number 
+// and its column. All numbers are LEB128, signed for line changes
+vector<char> Code::link_debug() const
+{
     vector<char> out;
-    out.insert(out.end(), header.begin(), header.end());
-    out.insert(out.end(), code_out.begin(), code_out.end());
+    vector<string> files;
+    out.push_back(1);
+
+    for (auto line : lines)
+    {
+        const string &file = std::get<1>(line).file_name;
+        if (std::find(files.begin(), files.end(), file) == files.end())
+            files.push_back(file);
+    }
+    write_uleb(out, files.size());
+    for (const string &file : files)
+        write_name(out, file);
+
+    int last_end = 0;
+    write_uleb(out, functions.size());
+    for (auto function : functions)
+    {
+        int start = std::get<0>(function);
+        int end = std::get<1>(function);
+        write_uleb(out, start - last_end);
+        write_uleb(out, end - start);
+        write_name(out, std::get<2>(function));
+        last_end = end;
+    }
+
+    int last_offset = 0, last_line = 0;
+    write_uleb(out, lines.size());
+    for (auto line : lines)
+    {
+        int offset = std::get<0>(line);
+        const DebugInfo &debug_info = std::get<1>(line);
+        int file = std::find(files.begin(), files.end(), 
+            debug_info.file_name) - files.begin();
+
+        write_uleb(out, offset - last_offset);
+        write_uleb(out, file);
+        write_sleb(out, debug_info.line_no - last_line);
+        write_uleb(out, debug_info.char_no);
+        last_offset = offset;
+        last_line = debug_info.line_no;
+    }
 
     return out;
 }
@@ -55,18 +222,152 @@ void Code::write_int(int i)
         code.push_back((i >> j*8) & 0xFF);
 }
 
+static bool is_byte_offset(int location)
+{
+    return location >= -128 && location <= 127;
+}
+
+static bool is_byte_size(int size)
+{
+    return size >= 0 && size <= 127;
+}
+
+static bool is_typed_size(int size)
+{
+    return size == 1 || size == 4 || size == 8;
+}
+
+void Code::write_load_local(int size, int location)
+{
+    if (!is_byte_offset(location))
+    {
+        write_byte(BC_LOAD_LOCAL_W);
+        write_int(size);
+        write_int(location);
+        return;
+    }
+
+    switch (size)
+    {
+        case 1: write_byte(BC_LOAD_LOCAL_1); break;
+        case 4: write_byte(BC_LOAD_LOCAL_4); break;
+        case 8: write_byte(BC_LOAD_LOCAL_8); break;
+        default: write_byte(BC_LOAD_LOCAL_X); write_int(size); break;
+    }
+    write_byte(location);
+}
+
+void Code::write_store_local(int size, int location)
+{
+    if (!is_byte_offset(location))
+    {
+        write_byte(BC_STORE_LOCAL_W);
+        write_int(size);
+        write_int(location);
+        return;
+    }
+
+    switch (size)
+    {
+        case 1: write_byte(BC_STORE_LOCAL_1); break;
+        case 4: write_byte(BC_STORE_LOCAL_4); break;
+        case 8: write_byte(BC_STORE_LOCAL_8); break;
+        default: write_byte(BC_STORE_LOCAL_X); write_int(size); break;
+    }
+    write_byte(location);
+}
+
+void Code::write_local_ref(int location)
+{
+    if (!is_byte_offset(location))
+    {
+        write_byte(BC_LOCAL_REF_W);
+        write_int(location);
+        return;
+    }
+
+    write_byte(BC_LOCAL_REF);
+    write_byte(location);
+}
+
+void Code::write_pop(int size)
+{
+    if (!is_byte_size(size))
+    {
+        write_byte(BC_POP_W);
+        write_int(size);
+        return;
+    }
+
+    write_byte(BC_POP);
+    write_byte(size);
+}
+
+void Code::write_alloc(int size)
+{
+    if (!is_byte_size(size))
+    {
+        write_byte(BC_ALLOC_W);
+        write_int(size);
+        return;
+    }
+
+    write_byte(BC_ALLOC);
+    write_byte(size);
+}
+
+void Code::write_copy(int size)
+{
+    if (!is_byte_size(size))
+    {
+        write_byte(BC_COPY_W);
+        write_int(size);
+        return;
+    }
+
+    write_byte(BC_COPY);
+    write_byte(size);
+}
+
+void Code::write_return(int size, int arg_size)
+{
+    if (!is_byte_size(size) || !is_byte_size(arg_size))
+    {
+        write_byte(BC_RETURN_W);
+        write_int(size);
+        write_int(arg_size);
+        return;
+    }
+
+    write_byte(BC_RETURN);
+    write_byte(size);
+    write_byte(arg_size);
+}
+
 void Code::write_float(float f)
 {
     int i = *(int*)&f;
     write_int(i);
 }
 
-void Code::write_string(string str)
+// Strings are pushed null terminated from the constant pool
+void Code::write_constant(string str)
 {
-    write_byte(str.length() + 1);
-    for (char c : str)
-        write_byte(c);
-    write_byte('\0');
+    auto found = constant_offsets.find(str);
+    int offset;
+    if (found != constant_offsets.end())
+        offset = found->second;
+    else
+    {
+        offset = constants.size();
+        constants.insert(constants.end(), str.begin(), str.end());
+        constants.push_back('\0');
+        constant_offsets[str] = offset;
+    }
+
+    write_byte(BC_PUSH_CONST);
+    write_int(str.length() + 1);
+    write_int(offset);
 }
 
 void Code::write_label(string label)
@@ -109,6 +410,47 @@ int Code::find_funcion(string name)
     return std::get<1>(labels[name]);
 }
 
+int Code::find_external(const Symbol &symb)
+{
+    // Externals are numbered in the order they're first seen, 
+    // which is also their slot in the VM's link table
+    string name = Symbol::printout(symb);
+    for (int i = 0; i < externals.size(); i++)
+        if (Symbol::printout(externals[i]) == name)
+            return i;
+
+    externals.push_back(symb);
+    return externals.size() - 1;
+}
+
+void Code::mark_line(const DebugInfo &debug_info)
+{
+    // Nothing was written for the last position, so it's replaced
+    int offset = code.size();
+    if (!lines.empty() && std::get<0>(lines.back()) == offset)
+        lines.pop_back();
+    lines.push_back(std::make_tuple(offset, debug_info));
+}
+
+static const DebugInfo &start_of(NodeExpression *node)
+{
+    return node->get_data()->token.debug_info;
+}
+
+void Code::mark_statement(Node *node)
+{
+    switch (node->get_type())
+    {
+        case NodeType::Let: mark_line(((NodeLet*)node)->get_name().debug_info); break;
+        case NodeType::Assign: mark_line(start_of(((NodeAssign*)node)->get_left())); break;
+        case NodeType::Return: mark_line(start_of(((NodeReturn*)node)->get_value())); break;
+        case NodeType::If: mark_line(start_of(((NodeIf*)node)->get_condition())); break;
+        case NodeType::For: mark_line(start_of(((NodeFor*)node)->get_left())); break;
+        case NodeType::While: mark_line(start_of(((NodeWhile*)node)->get_condition())); break;
+        default: break;
+    }
+}
+
 string Code::gen_label()
 {
     int id;
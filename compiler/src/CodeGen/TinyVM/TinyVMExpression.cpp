@@ -6,7 +6,7 @@ extern "C"
 using namespace TinyScript::TinyVM;
 using namespace TinyScript;
 
-static char find_op_code(string name)
+static int find_op_code(string name)
 {
     int i;
     for (i = 0; i < BC_SIZE; i++)
@@ -23,7 +23,7 @@ static string str_upper(string str)
     return out;
 }
 
-void Code::compile_operation(Token op, DataType ltype, DataType rtype)
+int Code::find_operation(Token op, DataType ltype, DataType rtype, string form)
 {
     // Find the bytecode name of the operation
     string op_name;
@@ -36,14 +36,19 @@ void Code::compile_operation(Token op, DataType ltype, DataType rtype)
         case TokenType::MoreThan: op_name = "MORE_THAN"; break;
         case TokenType::LessThan: op_name = "LESS_THAN"; break;
         case TokenType::MoreThanEquals: op_name = "MORE_THAN_EQUALS"; break;
-        case TokenType::LessThanEquals: op_name = "MORE_THAN_EQUALS"; break;
+        case TokenType::LessThanEquals: op_name = "LESS_THAN_EQUALS"; break;
         case TokenType::Equals: op_name = "EQUALS"; break;
     }
 
     // Create the bytecode name string for the types and find the code
     string code_name = "BC_" + op_name + "_" + str_upper(ltype.construct->name) + 
-        "_" + str_upper(rtype.construct->name);
-    char bytecode = find_op_code(code_name);
+        "_" + str_upper(rtype.construct->name) + form;
+    return find_op_code(code_name);
+}
+
+void Code::compile_operation(Token op, DataType ltype, DataType rtype)
+{
+    int bytecode = find_operation(op, ltype, rtype);
     if (bytecode == -1)
     {
         // If that operation has not been implemented
@@ -63,10 +68,7 @@ void Code::compile_call(const Symbol &symb, ExpDataNode *node)
     // Allocate the return space
     int return_size = DataType::find_size(symb.type);
     if (return_size > 0)
-    {
-        write_byte(BC_ALLOC);
-        write_byte(return_size);
-    }
+        write_alloc(return_size);
 
     // Push the arguments onto the stack
     for (int i = node->args.size() - 1; i >= 0; i--)
@@ -77,7 +79,7 @@ void Code::compile_call(const Symbol &symb, ExpDataNode *node)
     {
         // Call external symbol
         write_byte(BC_CALL_EXTERNAL);
-        write_int(symb.location);
+        write_int(find_external(symb));
     }
     else
     {
@@ -103,24 +105,37 @@ void Code::compile_rname(ExpDataNode *node)
     // Push local to the stack
     if (symb.flags & SYMBOL_LOCAL)
     {
-        write_byte(BC_LOAD_LOCAL_X);
-        write_int(DataType::find_size(symb.type));
-        write_byte(symb.location);
+        write_load_local(DataType::find_size(symb.type), symb.location);
     }
 }
 
 void Code::compile_ref(ExpDataNode *node)
 {
     Symbol lvalue = find_lvalue_location(node->left);
-    write_byte(BC_LOCAL_REF);
-    write_byte(lvalue.location);
+    write_local_ref(lvalue.location);
 }
 
 void Code::compile_copy(ExpDataNode *node)
 {
     compile_rvalue(node->left);
-    write_byte(BC_COPY);
-    write_byte(DataType::find_size(node->type));
+    write_copy(DataType::find_size(node->type));
+}
+
+void Code::compile_new(ExpDataNode *node)
+{
+    // Without a count it's just the one
+    if (node->left != nullptr)
+    {
+        compile_rvalue(node->left);
+    }
+    else
+    {
+        write_byte(BC_PUSH_4);
+        write_int(1);
+    }
+
+    write_byte(BC_NEW);
+    write_int(DataType::find_size(*node->type.sub_type));
 }
 
 void Code::compile_array(ExpDataNode *node)
@@ -163,8 +178,7 @@ void Code::compile_typename(ExpDataNode *node)
     DataType type = node->left->type;
     string name = DataType::printout(type);
 
-    write_byte(BC_PUSH_X);
-    write_string(name);
+    write_constant(name);
 }
 
 void Code::compile_arraysize(ExpDataNode *node)
@@ -188,11 +202,12 @@ void Code::compile_rterm(ExpDataNode *node)
         case TokenType::Float: write_byte(BC_PUSH_4); write_float(atof(str)); break;
         case TokenType::Bool: write_byte(BC_PUSH_1); write_byte(value.data == "true" ? 1 : 0); break;
         case TokenType::Char: write_byte(BC_PUSH_1); write_byte(value.data[0]); break;
-        case TokenType::String: write_byte(BC_PUSH_X); write_string(value.data); break;
+        case TokenType::String: write_constant(value.data); break;
         case TokenType::Name: compile_rname(node); break;
         case TokenType::Ref: compile_ref(node); break;
         case TokenType::As: compile_cast(node); break;
         case TokenType::Copy: compile_copy(node); break;
+        case TokenType::New: compile_new(node); break;
         case TokenType::OpenIndex: compile_array(node); break;
         case TokenType::TypeSize: compile_typesize(node); break;
         case TokenType::TypeName: compile_typename(node); break;
@@ -212,8 +227,7 @@ void Code::compile_index(ExpDataNode *node)
         write_int(element_size);
         write_byte(BC_MUL_INT_INT);
         write_byte(BC_ADD_INT_INT);
-        write_byte(BC_COPY);
-        write_byte(DataType::find_size(node->type));
+        write_copy(DataType::find_size(node->type));
     }
     else
     {
@@ -241,8 +255,7 @@ void Code::compile_rin(ExpDataNode *node)
         write_byte(BC_PUSH_4);
         write_int(offset);
         write_byte(BC_ADD_INT_INT);
-        write_byte(BC_COPY);
-        write_byte(size);
+        write_copy(size);
     }
     else
     {
@@ -303,15 +316,13 @@ void Code::compile_lname(ExpDataNode *node)
 
     if (symb.type.flags & DATATYPE_REF)
     {
-        write_byte(BC_LOAD_LOCAL_4);
-        write_byte(symb.location);
+        write_load_local(4, symb.location);
         return;
     }
 
     if (symb.flags & SYMBOL_LOCAL)
     {
-        write_byte(BC_LOCAL_REF);
-        write_byte(symb.location);
+        write_local_ref(symb.location);
     }
 }
 
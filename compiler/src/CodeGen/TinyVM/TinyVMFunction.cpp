@@ -17,7 +17,10 @@ void Code::compile_function(NodeFunction *node)
         Symbol::printout(node->get_symb()) + "'");
 
     // Create stack frame
-    assign_label(Symbol::printout(node->get_symb()));
+    string label = Symbol::printout(node->get_symb());
+    int start = code.size();
+    mark_line(name.debug_info);
+    assign_label(label);
     write_byte(BC_CREATE_FRAME);
     int scope_size_loc = code.size();
     write_int(0);
@@ -26,12 +29,12 @@ void Code::compile_function(NodeFunction *node)
     compile_block((NodeBlock*)node);
 
     // Write default return statement
-    write_byte(BC_RETURN);
-    write_byte(0);
-    write_byte(node->get_arg_size());
+    write_return(0, node->get_arg_size());
 
-    int scope_size = node->get_scope_size();
+    int scope_size = finish_frame(node->get_scope_size());
     memcpy(&code[scope_size_loc], &scope_size, sizeof(int));
+    functions.push_back(std::make_tuple(start, (int)code.size(), label, 
+        DataType::printout(node->get_symb().type)));
     node->set_compiled();
 }
 
@@ -45,9 +48,7 @@ void Code::compile_return(NodeReturn *node)
 
     compile_rexpression(value);
     size = DataType::find_size(value->get_data_type());
-    write_byte(BC_RETURN);
-    write_byte(size);
-    write_byte(func->get_arg_size());
+    write_return(size, func->get_arg_size());
 }
 
 void Code::compile_block(NodeBlock *node)
@@ -56,6 +57,7 @@ void Code::compile_block(NodeBlock *node)
     for (int i = 0; i < node->get_child_size(); i++)
     {
         Node *child = (*node)[i];
+        mark_statement(child);
         switch (child->get_type())
         {
             case NodeType::Let: compile_let((NodeLet*)child); break;
@@ -84,9 +86,7 @@ void Code::compile_let(NodeLet *node)
         symb = node->get_symb();
 
         size = DataType::find_size(symb.type);
-        write_byte(BC_STORE_LOCAL_X);
-        write_int(size);
-        write_byte(symb.location);
+        write_store_local(size, symb.location);
     }
     else
         node->symbolize();
@@ -114,10 +114,7 @@ void Code::compile_assign(NodeAssign *node)
         
         int size = DataType::find_size(left->get_data_type());
         if (size > 0)
-        {
-            write_byte(BC_POP);
-            write_byte(size);
-        }
+            write_pop(size);
     }
 }
 
@@ -157,6 +154,7 @@ void Code::compile_for(NodeFor *node)
     compile_block((NodeCodeBlock*)node);
 
     // Increment by 1
+    mark_statement(node);
     compile_rexpression(node->get_left());
     write_byte(BC_PUSH_4);
     write_int(1);
@@ -186,6 +184,7 @@ void Code::compile_while(NodeWhile *node)
     compile_block((NodeCodeBlock*)node);
     
     // Jump to the start of the loop
+    mark_statement(node);
     write_byte(BC_JUMP);
     write_label(start);
     assign_label(end);
@@ -13,14 +13,7 @@ void Code::compile_import_from(NodeImportFrom *node)
 
 void Code::compile_external(NodeExtern *node)
 {
-    Symbol symb = node->get_symb();
-
-    // If the external has already been added, don't add it
-    for (Symbol external : externals)
-        if (external.location == symb.location)
-            return;
-
-    externals.push_back(symb);
+    find_external(node->get_symb());
 }
 
 void Code::compile_module(NodeModule *node)
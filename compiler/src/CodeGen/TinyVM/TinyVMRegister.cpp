@@ -0,0 +1,386 @@
+#include <memory.h>
+#include "CodeGen/TinyVMRegisterCode.hpp"
+extern "C"
+{
+#include "bytecode.h"
+}
+using namespace TinyScript::TinyVM;
+using namespace TinyScript;
+
+static bool is_prim(const DataType &type)
+{
+    if (type.flags & (DATATYPE_REF | DATATYPE_ARRAY))
+        return false;
+
+    return type.construct == PrimTypes::type_int() ||
+        type.construct == PrimTypes::type_float() ||
+        type.construct == PrimTypes::type_char() ||
+        type.construct == PrimTypes::type_bool();
+}
+
+static bool is_leaf(ExpDataNode *node)
+{
+    return !(node->flags & (NODE_OPERATION | NODE_CALL |
+        NODE_INDEX | NODE_IN | NODE_CAST));
+}
+
+bool RegisterCode::is_register_local(ExpDataNode *node)
+{
+    return is_leaf(node) &&
+        node->token.type == TokenType::Name &&
+        (node->symb.flags & SYMBOL_LOCAL) &&
+        is_prim(node->type);
+}
+
+bool RegisterCode::is_constant(ExpDataNode *node)
+{
+    if (!is_leaf(node))
+        return false;
+
+    switch (node->token.type)
+    {
+        case TokenType::Int:
+        case TokenType::Float:
+        case TokenType::Bool:
+        case TokenType::Char:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool RegisterCode::is_register_value(ExpDataNode *node)
+{
+    if (is_register_local(node) || is_constant(node))
+        return true;
+
+    if (!(node->flags & NODE_OPERATION))
+        return false;
+
+    return find_operation(node->token, node->left->type,
+            node->right->type, "_R") != -1 &&
+        is_register_value(node->left) &&
+        is_register_value(node->right);
+}
+
+RegisterCode::Register RegisterCode::alloc_temp(int size)
+{
+    Register reg = { temp_size, true };
+    temp_size += size;
+    max_temp_size = std::max(max_temp_size, temp_size);
+    return reg;
+}
+
+void RegisterCode::write_register(Register reg)
+{
+    if (reg.is_temp)
+        temp_operands.push_back(code.size());
+    write_int(reg.location);
+}
+
+int RegisterCode::finish_frame(int scope_size)
+{
+    for (int addr : temp_operands)
+    {
+        int location;
+        memcpy(&location, &code[addr], sizeof(int));
+        location += scope_size;
+        memcpy(&code[addr], &location, sizeof(int));
+    }
+
+    int frame_size = scope_size + max_temp_size;
+    temp_operands.clear();
+    temp_size = 0;
+    max_temp_size = 0;
+    return frame_size;
+}
+
+void RegisterCode::compile_constant(ExpDataNode *node, Register dest)
+{
+    Token value = node->token;
+    const char *str = value.data.c_str();
+
+    switch (value.type)
+    {
+        case TokenType::Int:
+            write_byte(BC_MOVE_CONST_4);
+            write_register(dest);
+            write_int(atoi(str));
+            break;
+
+        case TokenType::Float:
+            write_byte(BC_MOVE_CONST_4);
+            write_register(dest);
+            write_float(atof(str));
+            break;
+
+        case TokenType::Bool:
+            write_byte(BC_MOVE_CONST_1);
+            write_register(dest);
+            write_int(value.data == "true" ? 1 : 0);
+            break;
+
+        case TokenType::Char:
+            write_byte(BC_MOVE_CONST_1);
+            write_register(dest);
+            write_int(value.data[0]);
+            break;
+    }
+}
+
+RegisterCode::Register RegisterCode::compile_register(ExpDataNode *node,
+    const Register *dest)
+{
+    int size = DataType::find_size(node->type);
+
+    // Locals are already in a register, so only need moving if
+    // they're wanted somewhere else
+    if (is_register_local(node))
+    {
+        Register local = { node->symb.location, false };
+        if (dest == nullptr || dest->location == local.location)
+            return local;
+
+        write_byte(size == 1 ? BC_MOVE_1 : BC_MOVE_4);
+        write_register(*dest);
+        write_register(local);
+        return *dest;
+    }
+
+    if (is_constant(node))
+    {
+        Register reg = dest ? *dest : alloc_temp(size);
+        compile_constant(node, reg);
+        return reg;
+    }
+
+    // Use the immediate form if the right side is an int constant
+    ExpDataNode *left = node->left;
+    ExpDataNode *right = node->right;
+    int bytecode = -1;
+    if (right->token.type == TokenType::Int && is_constant(right))
+        bytecode = find_operation(node->token, left->type, right->type, "_I");
+    bool is_immediate = bytecode != -1;
+
+    int temp_start = temp_size;
+    Register lreg = compile_register(left);
+    Register rreg;
+    if (!is_immediate)
+    {
+        bytecode = find_operation(node->token, left->type, right->type, "_R");
+        rreg = compile_register(right);
+    }
+
+    // Both operands are read before the result is written,
+    // so the result can reuse their temps
+    temp_size = temp_start;
+    Register reg = dest ? *dest : alloc_temp(size);
+    write_byte(bytecode);
+    write_register(reg);
+    write_register(lreg);
+    if (is_immediate)
+        write_int(atoi(right->token.data.c_str()));
+    else
+        write_register(rreg);
+    return reg;
+}
+
+void RegisterCode::compile_rvalue(ExpDataNode *node)
+{
+    // A single operation on locals and constants is left to the stack 
+    // code, as it fuses into one superinstruction there anyway
+    bool is_nested = (node->flags & NODE_OPERATION) && 
+        ((node->left->flags & NODE_OPERATION) || 
+         (node->right->flags & NODE_OPERATION));
+    if (!is_nested || !is_register_value(node))
+    {
+        Code::compile_rvalue(node);
+        return;
+    }
+
+    // Work out the value in a temp, then push it for the stack code
+    int temp_start = temp_size;
+    Register reg = compile_register(node);
+    // The temp's offset isn't known until the frame is finished, so this
+    // always takes the wide form, which the VM narrows again on load
+    write_byte(BC_LOAD_LOCAL_W);
+    write_int(DataType::find_size(node->type));
+    write_register(reg);
+    temp_size = temp_start;
+}
+
+void RegisterCode::compile_let(NodeLet *node)
+{
+    Logger::log(node->get_name().debug_info, "Compile let");
+
+    NodeExpression *value = node->get_value();
+    if (value == nullptr)
+    {
+        node->symbolize();
+        return;
+    }
+
+    value->symbolize();
+    ExpDataNode *data = value->get_data();
+    node->symbolize();
+
+    Symbol symb = node->get_symb();
+    int size = DataType::find_size(symb.type);
+    if (is_register_value(data) && is_prim(symb.type) &&
+        size == DataType::find_size(data->type))
+    {
+        Register local = { symb.location, false };
+        compile_register(data, &local);
+        temp_size = 0;
+        return;
+    }
+
+    compile_rvalue(data);
+    write_store_local(size, symb.location);
+}
+
+void RegisterCode::compile_assign(NodeAssign *node)
+{
+    Logger::log(node->get_left()->get_data()->token.debug_info, "Compile assign");
+
+    NodeExpression *left = node->get_left();
+    NodeExpression *right = node->get_right();
+    if (right == nullptr)
+    {
+        Code::compile_assign(node);
+        return;
+    }
+
+    right->symbolize();
+    left->symbolize();
+
+    ExpDataNode *ldata = left->get_data();
+    ExpDataNode *rdata = right->get_data();
+    int size = DataType::find_size(rdata->type);
+    if (is_register_local(ldata) && is_register_value(rdata) &&
+        size == DataType::find_size(ldata->type))
+    {
+        Register local = { ldata->symb.location, false };
+        compile_register(rdata, &local);
+        temp_size = 0;
+        return;
+    }
+
+    compile_rvalue(rdata);
+    compile_lvalue(ldata);
+    write_byte(BC_ASSIGN_REF_X);
+    write_int(size);
+}
+
+void RegisterCode::compile_condition(NodeExpression *node, string end)
+{
+    node->symbolize();
+
+    ExpDataNode *data = node->get_data();
+    if (is_register_value(data) && DataType::find_size(data->type) == 1)
+    {
+        Register reg = compile_register(data);
+        write_byte(BC_JUMP_IF_NOT_R);
+        write_label(end);
+        write_register(reg);
+        temp_size = 0;
+        return;
+    }
+
+    compile_rvalue(data);
+    write_byte(BC_JUMP_IF_NOT);
+    write_label(end);
+}
+
+void RegisterCode::compile_if(NodeIf *node)
+{
+    string end = gen_label();
+
+    compile_condition(node->get_condition(), end);
+    compile_block((NodeBlock*)node);
+    assign_label(end);
+}
+
+void RegisterCode::compile_for(NodeFor *node)
+{
+    node->get_left()->symbolize();
+    node->get_from()->symbolize();
+    node->get_to()->symbolize();
+
+    ExpDataNode *left = node->get_left()->get_data();
+    ExpDataNode *from = node->get_from()->get_data();
+    ExpDataNode *to = node->get_to()->get_data();
+    if (!is_register_local(left) || left->type.construct != PrimTypes::type_int() ||
+        !is_register_value(from) || from->type.construct != PrimTypes::type_int() ||
+        !is_register_value(to) || to->type.construct != PrimTypes::type_int())
+    {
+        Code::compile_for(node);
+        return;
+    }
+
+    string start = gen_label();
+    string end = gen_label();
+    Register counter = { left->symb.location, false };
+
+    // Assign initial value
+    compile_register(from, &counter);
+    temp_size = 0;
+
+    // Check to see if within loop
+    assign_label(start);
+    if (to->token.type == TokenType::Int && is_constant(to))
+    {
+        Register check = alloc_temp(1);
+        write_byte(BC_LESS_THAN_INT_INT_I);
+        write_register(check);
+        write_register(counter);
+        write_int(atoi(to->token.data.c_str()));
+        write_byte(BC_JUMP_IF_NOT_R);
+        write_label(end);
+        write_register(check);
+    }
+    else
+    {
+        Register limit = compile_register(to);
+        Register check = alloc_temp(1);
+        write_byte(BC_MORE_THAN_INT_INT_R);
+        write_register(check);
+        write_register(limit);
+        write_register(counter);
+        write_byte(BC_JUMP_IF_NOT_R);
+        write_label(end);
+        write_register(check);
+    }
+    temp_size = 0;
+
+    compile_block((NodeCodeBlock*)node);
+
+    // Increment by 1 and jump to the start
+    mark_statement(node);
+    write_byte(BC_ADD_INT_INT_I);
+    write_register(counter);
+    write_register(counter);
+    write_int(1);
+    write_byte(BC_JUMP);
+    write_label(start);
+    assign_label(end);
+}
+
+void RegisterCode::compile_while(NodeWhile *node)
+{
+    string start = gen_label();
+    string end = gen_label();
+
+    // Exit loop if condition is not met
+    assign_label(start);
+    compile_condition(node->get_condition(), end);
+
+    // Compile main code
+    compile_block((NodeCodeBlock*)node);
+
+    // Jump to the start of the loop
+    mark_statement(node);
+    write_byte(BC_JUMP);
+    write_label(start);
+    assign_label(end);
+}
@@ -299,6 +299,25 @@ void NodeExpression::parse_copy(Tokenizer &tk, ExpDataNode *node)
     node->left = lnode;
 }
 
+void NodeExpression::parse_new(Tokenizer &tk, ExpDataNode *node)
+{
+    // Parse the type to allocate, then how many of it if it's given
+    NodeDataType *type_node = parse_node<NodeDataType>(tk);
+    DataType type = type_node->compile();
+    delete type_node;
+
+    if (tk.get_look().type == TokenType::OpenIndex)
+    {
+        tk.match(TokenType::OpenIndex, "[");
+        node->left = parse_expression(tk);
+        tk.match(TokenType::CloseIndex, "]");
+    }
+
+    // Gives a ref to the first one, which indexes like an array
+    node->type = DataType { PrimTypes::type_null(), DATATYPE_REF, 
+        0, std::make_shared<DataType>(type) };
+}
+
 void NodeExpression::parse_negate(Tokenizer &tk, ExpDataNode *node)
 {
     // Create an operation of 0 - <value> to negate
@@ -377,6 +396,7 @@ ExpDataNode *NodeExpression::parse_term(Tokenizer &tk)
         case TokenType::Subtract: parse_negate(tk, node); break;
         case TokenType::Ref: parse_ref(tk, node); break;
         case TokenType::Copy: parse_copy(tk, node); break;
+        case TokenType::New: parse_new(tk, node); break;
         case TokenType::TypeName: node = parse_type_name(tk, node); break;
         case TokenType::TypeSize: node = parse_type_size(tk, node); break;
         case TokenType::ArraySize: node = parse_array_size(tk, node); break;
@@ -517,6 +537,13 @@ void NodeExpression::symbolize_copy(ExpDataNode *node)
     node->type = *lnode->type.sub_type;
 }
 
+void NodeExpression::symbolize_new(ExpDataNode *node)
+{
+    ExpDataNode *count = node->left;
+    if (count != nullptr && count->type.construct != PrimTypes::type_int())
+        Logger::error(count->token.debug_info, "The count to new must be an int");
+}
+
 void NodeExpression::symbolize_typesize(ExpDataNode *node)
 {
     node->type = DataType { PrimTypes::type_int(), 0 };
@@ -647,6 +674,7 @@ void NodeExpression::symbolize_node(ExpDataNode *node)
             case TokenType::Name: symbolize_name(this, node); break;
             case TokenType::Ref: symbolize_ref(node); break;
             case TokenType::Copy: symbolize_copy(node); break;
+            case TokenType::New: symbolize_new(node); break;
             case TokenType::TypeSize: symbolize_typesize(node); break;
             case TokenType::TypeName: symbolize_typename(node); break;
             case TokenType::ArraySize: symbolize_arraysize(node); break;
@@ -280,7 +280,7 @@ const Symbol &NodeFunction::implement(vector<DataType> param_types)
 
         int size = DataType::find_size(type);
         allocator -= size;
-        arg_size += size;
+        imp->arg_size += size;
         imp->push_symbol(Symbol(name.data, type, 
             SYMBOL_LOCAL, allocator, imp));
     }
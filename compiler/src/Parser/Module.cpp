@@ -101,6 +101,13 @@ void NodeExtern::parse(Tokenizer &tk)
         tk.match(TokenType::CloseArg, ")");
     }
 
+    // Parse return type
+    if (tk.get_look().type == TokenType::Gives)
+    {
+        tk.match(TokenType::Gives, "->");
+        return_type_node = parse_node<NodeDataType>(tk);
+    }
+
     Logger::log(name.debug_info, "Parsing extern '" + name.data + "'");
 }
 
@@ -116,8 +123,8 @@ void NodeExtern::register_extern()
     for (NodeDataType *type : param_nodes)
         params.push_back(type->compile());
 
-    // Create external symbol
-    symb = Symbol(name.data, return_type, SYMBOL_FUNCTION | SYMBOL_EXTERNAL, rand(), this);
+    // Create external symbol, the code generator gives it an index when linking
+    symb = Symbol(name.data, return_type, SYMBOL_FUNCTION | SYMBOL_EXTERNAL, 0, this);
     symb.params = params;
     get_parent(NodeType::Module)->push_symbol(symb);
 }
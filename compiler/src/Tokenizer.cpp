@@ -8,6 +8,7 @@ static map<string, TokenType> keywords =
     std::make_pair("ref", TokenType::Ref),
     std::make_pair("array", TokenType::Array),
     std::make_pair("copy", TokenType::Copy),
+    std::make_pair("new", TokenType::New),
     std::make_pair("as", TokenType::As),
     std::make_pair("func", TokenType::Func),
     std::make_pair("class", TokenType::Class),
@@ -128,7 +129,7 @@ Token Tokenizer::next_token()
             case ':': return parse_double(c, TokenType::Of, equal, dbi);
             
             case '>': return parse_double(c, TokenType::MoreThan, more, dbi);
-            case '<': return parse_double(c, TokenType::LessThan, more, dbi);
+            case '<': return parse_double(c, TokenType::LessThan, less, dbi);
 
             case '{': return Token { string(1, c), TokenType::OpenBlock, dbi };
             case '}': return Token { string(1, c), TokenType::CloseBlock, dbi };
@@ -12,6 +12,17 @@
 #define ARC_C   1
 
 // VM settings
-#define STACK_MEMORY    1024 * 1024 // 1mb
+#define STACK_MEMORY    1024 * 1024 // 1mb, default stack reservation for a context
+#define VM_STACK_GUARD  64 * 1024 // Size of the region after the stack that catches overflows
+#define VM_HEAP_MEMORY  4 * 1024 * 1024 // 4mb, heap reservation for a context that new allocates from
+#define VM_THREADED_DISPATCH    1 // Use computed goto dispatch when supported
+#define VM_FUSION               1 // Fuse common opcode sequences into superinstructions
+#define VM_JIT                  1 // Compile functions to x86-64 when every opcode has a template
+#define VM_TIERED               1 // Only fuse and compile functions once they get hot
+#define VM_TIER_FUSE_THRESHOLD  2 // Calls plus back-edges before a function is fused
+#define VM_TIER_JIT_THRESHOLD   1000 // Calls plus back-edges before a function is compiled
+#define VM_PROFILE_RATE         1000 // Samples per second of CPU time taken by --profile
+#define VM_PROFILE_DEPTH        64 // Frames kept from the top of each sampled call chain
+#define VM_PROFILE_BUFFER       1024 * 1024 // Ints of sample memory a profile reserves
 
 #endif // FLAG_H
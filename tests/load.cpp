@@ -0,0 +1,70 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "flags.h"
+extern "C"
+{
+#include "vm.h"
+#include "format.h"
+#include "bytecode.h"
+}
+using std::vector;
+
+// Wraps code in a header with empty imports and exports, putting it 
+// last at the very end of its own allocation, so reading past it leaves 
+// the buffer
+static char *link_code(const vector<char> &code, int *size)
+{
+    int header[] = { 0, VM_FORMAT_VERSION, -1, 3, 
+        VM_SECTION_IMPORTS, 52, 4, 
+        VM_SECTION_EXPORTS, 56, 4, 
+        VM_SECTION_CODE, 60, (int)code.size(), 
+        0, 0 };
+    memcpy(header, VM_FORMAT_MAGIC, 4);
+
+    *size = sizeof(header) + code.size();
+    char *data = (char*)malloc(*size);
+    memcpy(data, header, sizeof(header));
+    memcpy(data + sizeof(header), code.data(), code.size());
+    return data;
+}
+
+static int expect_rejected(VMContext *context, const char *name, 
+    const vector<char> &code)
+{
+    int size;
+    char *data = link_code(code, &size);
+    VMScript *script = vm_load(context, data, size);
+    free(data);
+
+    if (script != NULL)
+    {
+        printf("FAIL: %s was loaded\n", name);
+        vm_unload(script);
+        return 1;
+    }
+    return 0;
+}
+
+// Code that ends part way through an instruction's operands is rejected 
+// before any of them are read
+int main()
+{
+    VMContext *context = vm_create(STACK_MEMORY);
+    int failed = 0;
+
+    failed += expect_rejected(context, "PUSH_X without its data", 
+        { BC_PUSH_X, (char)0xFF });
+    failed += expect_rejected(context, "PUSH_X without its length", 
+        { BC_PUSH_X });
+    failed += expect_rejected(context, "PUSH_4 without all of its int", 
+        { BC_PUSH_4, 1, 2 });
+
+    vm_free(context);
+    if (failed)
+        return 1;
+
+    printf("ok\n");
+    return 0;
+}
@@ -12,6 +12,34 @@
     GEN(BC_LESS_THAN_EQUALS_##types, 0) \
     GEN(BC_EQUALS_##types, 0) \
 
+// Register forms of the operations, which name their frame slots directly 
+// as 'op dst, left, right' rather than going through the stack. Each operand 
+// is a byte offset from the base pointer. There are no char and int or 
+// char and float forms, as their results are wider than the char type the 
+// compiler gives them
+#define BC_REGISTER_SET(GEN, types) \
+    GEN(BC_ADD_##types##_R, 12) \
+    GEN(BC_SUB_##types##_R, 12) \
+    GEN(BC_MUL_##types##_R, 12) \
+    GEN(BC_DIV_##types##_R, 12) \
+    GEN(BC_MORE_THAN_##types##_R, 12) \
+    GEN(BC_LESS_THAN_##types##_R, 12) \
+    GEN(BC_MORE_THAN_EQUALS_##types##_R, 12) \
+    GEN(BC_LESS_THAN_EQUALS_##types##_R, 12) \
+    GEN(BC_EQUALS_##types##_R, 12) \
+
+// Same as above, but with an immediate int as the right operand
+#define BC_IMMEDIATE_SET(GEN, types) \
+    GEN(BC_ADD_##types##_I, 12) \
+    GEN(BC_SUB_##types##_I, 12) \
+    GEN(BC_MUL_##types##_I, 12) \
+    GEN(BC_DIV_##types##_I, 12) \
+    GEN(BC_MORE_THAN_##types##_I, 12) \
+    GEN(BC_LESS_THAN_##types##_I, 12) \
+    GEN(BC_MORE_THAN_EQUALS_##types##_I, 12) \
+    GEN(BC_LESS_THAN_EQUALS_##types##_I, 12) \
+    GEN(BC_EQUALS_##types##_I, 12) \
+
 #define PRIM_CAST_SET(GEN, to) \
     GEN(BC_CAST_INT_##to, 0) \
     GEN(BC_CAST_FLOAT_##to, 0) \
@@ -59,20 +87,115 @@
     PRIM_CAST_SET(GEN, CHAR) \
     PRIM_CAST_SET(GEN, BOOL) \
      \
+    /* Register instructions */ \
+    GEN(BC_MOVE_1, 8) \
+    GEN(BC_MOVE_4, 8) \
+    GEN(BC_MOVE_X, 12) \
+    GEN(BC_MOVE_CONST_1, 8) \
+    GEN(BC_MOVE_CONST_4, 8) \
+    GEN(BC_JUMP_IF_NOT_R, 8) \
+    BC_REGISTER_SET(GEN, INT_INT) \
+    BC_REGISTER_SET(GEN, INT_FLOAT) \
+    BC_REGISTER_SET(GEN, INT_CHAR) \
+    BC_REGISTER_SET(GEN, FLOAT_INT) \
+    BC_REGISTER_SET(GEN, FLOAT_FLOAT) \
+    BC_REGISTER_SET(GEN, FLOAT_CHAR) \
+    BC_REGISTER_SET(GEN, CHAR_CHAR) \
+    BC_IMMEDIATE_SET(GEN, INT_INT) \
+     \
+    /* Typed locals, with a byte offset like the 4 byte forms */ \
+    GEN(BC_STORE_LOCAL_1, 1) \
+    GEN(BC_STORE_LOCAL_8, 1) \
+    GEN(BC_LOAD_LOCAL_1, 1) \
+    GEN(BC_LOAD_LOCAL_8, 1) \
+     \
+    /* Wide locals, for offsets that don't fit in a byte. The size and */ \
+    /* offset are both ints */ \
+    GEN(BC_STORE_LOCAL_W, 8) \
+    GEN(BC_LOAD_LOCAL_W, 8) \
+    GEN(BC_LOCAL_REF_W, 4) \
+     \
+    /* Push size bytes from an offset in the constant pool */ \
+    GEN(BC_PUSH_CONST, 8) \
+     \
+    /* Pop a count and push a ref to that many values of a size in the */ \
+    /* heap, which is freed when the call from the host finishes */ \
+    GEN(BC_NEW, 4) \
+     \
+    /* Wide sizes, for values too big for a signed byte. Sizes are ints, */ \
+    /* and RETURN gives the return size then the arg size */ \
+    GEN(BC_POP_W, 4) \
+    GEN(BC_ALLOC_W, 4) \
+    GEN(BC_COPY_W, 4) \
+    GEN(BC_RETURN_W, 8) \
+     \
     GEN(BC_SIZE, 0)
 
+// Superinstructions, these never appear in linked code but are fused from 
+// the sequence of codes given when the VM loads it. The sequences are built 
+// by chaining the most frequent pairs in the opcode pair profile 
+// (--counts) of the scripts in bench/. Only the last code may change the pc.
+// Local loads and stores are matched in their typed form, as the decoder 
+// turns every sized and wide form with a 1, 4 or 8 byte size into one
+//
+//  Pair                                Count (fib, loop, array)
+//  LOAD_LOCAL_4 PUSH_4                 75.9m
+//  LOCAL_REF ASSIGN_REF_X              29.5m
+//  PUSH_4 LESS_THAN_INT_INT            29.0m
+//  LESS_THAN_INT_INT JUMP_IF_NOT       29.0m
+//  ADD_INT_INT LOCAL_REF               29.0m
+//  LOAD_LOCAL_4 LOAD_LOCAL_4           22.5m
+//  PUSH_4 SUB_INT_INT                  18.5m
+//  SUB_INT_INT CALL                    18.5m
+//  ASSIGN_REF_X JUMP                   14.5m
+//  PUSH_4 ADD_INT_INT                  14.5m
+//  PUSH_4 MUL_INT_INT                  14.0m
+//  MUL_INT_INT ADD_INT_INT             14.0m
+//  MORE_THAN_INT_INT JUMP_IF_NOT        4.5m
+//  ADD_INT_INT COPY                     4.0m
+//
+// The register forms pair a compare with its branch, and a loop counter 
+// increment with the jump back to the loop condition
+#define FOR_EACH_FUSED(GEN) \
+    GEN(BC_INC_LOCAL, BC_LOAD_LOCAL_4, BC_PUSH_4, BC_ADD_INT_INT, BC_LOCAL_REF, BC_ASSIGN_REF_X) \
+    GEN(BC_LOCAL_LESS_THAN_JUMP, BC_LOAD_LOCAL_4, BC_PUSH_4, BC_LESS_THAN_INT_INT, BC_JUMP_IF_NOT) \
+    GEN(BC_LOCAL_SUB_CALL, BC_LOAD_LOCAL_4, BC_PUSH_4, BC_SUB_INT_INT, BC_CALL) \
+    GEN(BC_INDEX_REF, BC_PUSH_4, BC_MUL_INT_INT, BC_ADD_INT_INT, BC_COPY) \
+    GEN(BC_ADD_ASSIGN_LOCAL, BC_ADD_INT_INT, BC_LOCAL_REF, BC_ASSIGN_REF_X) \
+    GEN(BC_LOAD_LOCAL_PUSH_4, BC_LOAD_LOCAL_4, BC_PUSH_4) \
+    GEN(BC_LOAD_LOCAL_LOAD_LOCAL, BC_LOAD_LOCAL_4, BC_LOAD_LOCAL_4) \
+    GEN(BC_ASSIGN_LOCAL, BC_LOCAL_REF, BC_ASSIGN_REF_X) \
+    GEN(BC_PUSH_4_ADD, BC_PUSH_4, BC_ADD_INT_INT) \
+    GEN(BC_PUSH_4_MUL, BC_PUSH_4, BC_MUL_INT_INT) \
+    GEN(BC_LESS_THAN_JUMP, BC_LESS_THAN_INT_INT, BC_JUMP_IF_NOT) \
+    GEN(BC_MORE_THAN_JUMP, BC_MORE_THAN_INT_INT, BC_JUMP_IF_NOT) \
+    GEN(BC_LESS_THAN_JUMP_R, BC_LESS_THAN_INT_INT_R, BC_JUMP_IF_NOT_R) \
+    GEN(BC_MORE_THAN_JUMP_R, BC_MORE_THAN_INT_INT_R, BC_JUMP_IF_NOT_R) \
+    GEN(BC_LESS_THAN_JUMP_I, BC_LESS_THAN_INT_INT_I, BC_JUMP_IF_NOT_R) \
+    GEN(BC_MORE_THAN_JUMP_I, BC_MORE_THAN_INT_INT_I, BC_JUMP_IF_NOT_R) \
+    GEN(BC_ADD_JUMP_I, BC_ADD_INT_INT_I, BC_JUMP)
+
+// Number of codes in a fused sequence, up to 5
+#define FUSED_LENGTH(...) FUSED_LENGTH_(__VA_ARGS__, 5, 4, 3, 2, 1)
+#define FUSED_LENGTH_(_1, _2, _3, _4, _5, N, ...) N
+
 #define GENERATE_ENUM(ENUM, size) ENUM,
 #define GENERATE_STRING(STRING, size) #STRING,
 #define GENERATE_SIZE(STRING, size) size,
+#define GENERATE_FUSED_ENUM(ENUM, ...) ENUM,
+#define GENERATE_FUSED_STRING(STRING, ...) #STRING,
 
 typedef enum Bytecode
 {
     FOR_EACH_CODE(GENERATE_ENUM)
+    FOR_EACH_FUSED(GENERATE_FUSED_ENUM)
+    BC_COUNT
 } Bytecode;
 
 static const char *bytecode_names[] = 
 {
     FOR_EACH_CODE(GENERATE_STRING)
+    FOR_EACH_FUSED(GENERATE_FUSED_STRING)
 };
 
 static const int bytecode_size[] = 
@@ -0,0 +1,47 @@
+#ifndef COUNTS_H
+#define COUNTS_H
+
+#include "bytecode.h"
+#include <stdio.h>
+
+// What the counting interpreter loop has run. Fused opcodes are counted 
+// as themselves, and pairs are indexed first * BC_COUNT + second
+typedef struct VMCounts
+{
+    int running;
+    long long *opcodes;
+    long long *pairs;
+    int last_op;
+
+    // Indexed by the order externals were registered in the context
+    long long *externals;
+    int external_size;
+} VMCounts;
+
+void counts_start(VMCounts *counts, int external_size);
+void counts_stop(VMCounts *counts);
+void counts_free(VMCounts *counts);
+
+// Externals registered after counting started need room too
+void counts_reserve(VMCounts *counts, int external_size);
+
+// Pairs don't carry over from one call into the next
+static inline void counts_enter(VMCounts *counts)
+{
+    counts->last_op = BC_SIZE;
+}
+
+static inline void counts_op(VMCounts *counts, int op)
+{
+    counts->opcodes[op] += 1;
+    if (counts->last_op != BC_SIZE)
+        counts->pairs[counts->last_op * BC_COUNT + op] += 1;
+    counts->last_op = op;
+}
+
+// Writes a JSON object with the total dispatches and every non zero 
+// count, highest first. Names are the externals' in registered order
+void counts_write(const VMCounts *counts, FILE *file, 
+    const char *const *external_names);
+
+#endif // COUNTS_H
@@ -0,0 +1,37 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+typedef struct VMDebugFunction
+{
+    int start;
+    int end;
+    char *name;
+} VMDebugFunction;
+
+typedef struct VMDebugLine
+{
+    int offset;
+    int file;
+    int line;
+    int column;
+} VMDebugLine;
+
+// The debug section of linked code, decoded into tables sorted by
+// code offset. Lines run up to the start of the next one
+typedef struct VMDebug
+{
+    char **files;
+    int file_count;
+    VMDebugFunction *functions;
+    int function_count;
+    VMDebugLine *lines;
+    int line_count;
+} VMDebug;
+
+// Code linked without a debug section decodes to empty tables
+int debug_decode(VMDebug *debug, const char *data, int size);
+const VMDebugFunction *debug_find_function(const VMDebug *debug, int offset);
+const VMDebugLine *debug_find_line(const VMDebug *debug, int offset);
+void debug_free(VMDebug *debug);
+
+#endif // DEBUG_H
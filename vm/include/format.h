@@ -0,0 +1,72 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+// Linked code starts with a header and a directory of its sections, so 
+// a loader can go straight to the ones it wants and skip any it doesn't 
+// know. Every number is a 4 byte little endian int, and sections start 
+// 4 byte aligned
+//
+//   "TSVM", version, entry function offset or -1, section count
+//   kind, offset from the start and size of each section
+//
+// Offsets into code are from the start of the code section
+#define VM_FORMAT_MAGIC "TSVM"
+#define VM_FORMAT_VERSION 2
+
+typedef enum VMSectionKind
+{
+    // The bytecode itself
+    VM_SECTION_CODE = 1,
+
+    // Externals in slot order, each as the size of its args, which it 
+    // pops itself, then its name as a length and that many bytes
+    VM_SECTION_IMPORTS,
+
+    // Functions sorted by name, each as its offset then its name, and 
+    // from version 2 on the name of its return type
+    VM_SECTION_EXPORTS,
+
+    // Data that PUSH_CONST pushes from
+    VM_SECTION_CONSTANTS,
+
+    // Optional, see debug.h
+    VM_SECTION_DEBUG,
+
+    VM_SECTION_COUNT
+} VMSectionKind;
+
+typedef struct VMSection
+{
+    const char *data;
+    int size;
+} VMSection;
+
+// Sections are indexed by kind, ones that aren't there are left empty
+typedef struct VMFormat
+{
+    int version;
+    int entry;
+    VMSection sections[VM_SECTION_COUNT];
+} VMFormat;
+
+// Checks the header and that every section is inside the data, gives 
+// -1 after printing what's wrong
+int format_read(VMFormat *format, const char *data, int size);
+
+// Reads ints and names out of a section in turn. Reading past the end 
+// sets error and gives 0 or NULL from then on
+typedef struct VMReader
+{
+    const char *data;
+    int size;
+    int pos;
+    int error;
+} VMReader;
+
+void format_reader(VMReader *reader, const VMSection *section);
+int format_read_int(VMReader *reader);
+
+// Names aren't null terminated, so come with their length
+const char *format_read_name(VMReader *reader, int *length);
+
+#endif // FORMAT_H
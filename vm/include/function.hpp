@@ -0,0 +1,230 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <string>
+extern "C"
+{
+#include "vm.h"
+}
+
+namespace TinyScript::TinyVM
+{
+
+    // The script type each C++ type passes as, which is also how it's
+    // written in mangled names
+    template<typename T>
+    struct ScriptType
+    {
+        static_assert(sizeof(T) == 0,
+            "Only int, float, char and bool can be passed to scripts");
+    };
+
+    template<> struct ScriptType<int>
+        { static const char *name() { return "int"; } };
+    template<> struct ScriptType<float>
+        { static const char *name() { return "float"; } };
+    template<> struct ScriptType<char>
+        { static const char *name() { return "char"; } };
+    template<> struct ScriptType<bool>
+        { static const char *name() { return "bool"; } };
+    template<> struct ScriptType<void>
+        { static const char *name() { return "null"; } };
+
+    // Host memory mapped into a context by vm_map, passed to a T ref 
+    // param as the ref it was given
+    template<typename T>
+    struct Ref
+    {
+        int ref;
+    };
+
+    template<typename T> struct ScriptType<Ref<T>>
+    {
+        static const char *name()
+        {
+            static const std::string name = 
+                std::string(ScriptType<T>::name()) + " ref";
+            return name.c_str();
+        }
+    };
+
+    // Maps count values for as long as it's alive, and converts to the
+    // Ref a Function takes, so scripts work on them in place
+    template<typename T>
+    class View
+    {
+    public:
+        View(VMContext *context, T *data, int count)
+            : context(context)
+        {
+            ref.ref = vm_map(context, data, count * (int)sizeof(T));
+        }
+
+        ~View()
+        {
+            if (ref.ref != -1)
+                vm_unmap(context, ref.ref);
+        }
+
+        View(const View&) = delete;
+        View &operator=(const View&) = delete;
+
+        bool is_mapped() const { return ref.ref != -1; }
+        operator Ref<T>() const { return ref; }
+
+    private:
+        VMContext *context;
+        Ref<T> ref;
+
+    };
+
+    template<typename... Args>
+    struct ArgSize
+    {
+        static const int value = 0;
+    };
+
+    template<typename T, typename... Rest>
+    struct ArgSize<T, Rest...>
+    {
+        static const int value = sizeof(T) + ArgSize<Rest...>::value;
+    };
+
+    // Somewhere for the return value to go, which void doesn't have
+    template<typename R>
+    struct ReturnSlot
+    {
+        static const int size = sizeof(R);
+        R value = R();
+        char *data() { return (char*)&value; }
+        R get() const { return value; }
+    };
+
+    template<>
+    struct ReturnSlot<void>
+    {
+        static const int size = 0;
+        char *data() { return nullptr; }
+        void get() const {}
+    };
+
+    template<typename Signature>
+    class Function;
+
+    // A script function called with C++ types, such as
+    // Function<float(int, float)>. Binding looks it up by its name
+    // mangled from the param types, and checks its return type and
+    // sizes once, so calls only have to copy the args into the stack
+    template<typename R, typename... Args>
+    class Function<R(Args...)>
+    {
+    public:
+        Function() : script(nullptr), function(nullptr) {}
+        Function(VMScript *script, const std::string &name)
+            : Function() { bind(script, name); }
+
+        // The name is without params, such as "calc.add". Gives false
+        // after printing why if the script has no function that fits
+        bool bind(VMScript *script, const std::string &name)
+        {
+            this->script = nullptr;
+            this->function = nullptr;
+
+            std::string mangled = mangle(name);
+            const VMFunction *found = vm_get_function(script, mangled.c_str());
+            if (found == nullptr)
+            {
+                printf("Error: No function '%s'\n", mangled.c_str());
+                return false;
+            }
+
+            const char *return_name = ScriptType<R>::name();
+            if (found->return_type != nullptr &&
+                strcmp(found->return_type, return_name))
+            {
+                printf("Error: '%s' returns %s, not %s\n",
+                    mangled.c_str(), found->return_type, return_name);
+                return false;
+            }
+
+            if (found->arg_size != ArgSize<Args...>::value ||
+                found->return_size != ReturnSlot<R>::size)
+            {
+                printf("Error: '%s' doesn't lay out its args and return "
+                    "value as %s would\n", mangled.c_str(), return_name);
+                return false;
+            }
+
+            this->script = script;
+            this->function = found;
+            return true;
+        }
+
+        bool is_bound() const { return function != nullptr; }
+
+        // Gives what vm_invoke does, with the return value copied to
+        // result, which can be null
+        int invoke(R *result, Args... args) const
+        {
+            if (function == nullptr)
+            {
+                printf("Error: Calling a function that isn't bound\n");
+                return -1;
+            }
+
+            if (vm_begin_call(script, function))
+                return -1;
+
+            // The compiler pushes args last first, so the first ends up
+            // nearest the frame, at the end
+            char *at = vm_arg_data(script) + ArgSize<Args...>::value;
+            int expand[] = { 0, (at -= sizeof(Args),
+                memcpy(at, &args, sizeof(Args)), 0)... };
+            (void)expand;
+
+            return vm_invoke(script, (char*)result);
+        }
+
+        // Gives the return value, or R() if the call didn't finish
+        R operator()(Args... args) const
+        {
+            ReturnSlot<R> slot;
+            invoke((R*)slot.data(), args...);
+            return slot.get();
+        }
+
+        // Runs a row for each of count values in the columns, one for
+        // each param, giving what vm_call_batch does
+        int batch(int count, R *results, const Args *... columns) const
+        {
+            if (function == nullptr)
+            {
+                printf("Error: Calling a function that isn't bound\n");
+                return -1;
+            }
+
+            VMColumn column_list[] =
+                { { columns, (int)sizeof(Args) }..., { nullptr, 0 } };
+            return vm_call_batch(script, function, column_list,
+                sizeof...(Args), count, (char*)results);
+        }
+
+    private:
+        static std::string mangle(const std::string &name)
+        {
+            if (sizeof...(Args) == 0)
+                return name;
+
+            const char *params[] = { ScriptType<Args>::name()..., nullptr };
+            std::string mangled = name + "(";
+            for (int i = 0; params[i] != nullptr; i++)
+                mangled += std::string(i > 0 ? ", " : "") + params[i];
+            return mangled + ")";
+        }
+
+        VMScript *script;
+        const VMFunction *function;
+
+    };
+
+}
@@ -0,0 +1,68 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "vm.h"
+#include "program.h"
+#include "stack.h"
+#include "flags.h"
+
+// The JIT writes x86-64 machine code and needs mmap for executable memory
+#if VM_JIT && defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+// Runs a function from its first instruction, with the return index
+// already pushed by the caller. Gives the stack pointer after it returns
+typedef int (*VMNative)(char *stack, int sp, int bp, void *jit);
+
+typedef struct VMJit
+{
+    // Native entry for each instruction that starts a compiled
+    // function, or NULL if it's still run by the interpreter
+    VMNative *natives;
+
+    // Native entry at the start of each loop in a compiled function, so
+    // a loop already running in the interpreter can move over. Like a
+    // function entry it runs through to the return
+    VMNative *loops;
+
+    const VMProgram *program;
+    VMFunc *links;
+
+    // Where to keep the newest frame's base pointer, and the stack it's 
+    // in, which also has the views refs past its guard region go to
+    volatile sig_atomic_t *frame;
+    VMStack *stack;
+
+    // Native calls nest on the host's stack rather than the VM's, where 
+    // the guard region can't catch them. A call that would take the 
+    // host's stack below the floor stops as an overflow instead, which 
+    // the interpreter sets to half the host's stack below itself
+    char *host_floor;
+    long long host_budget;
+
+    // Start of the function each instruction is in, and whether that
+    // function and everything it calls has a template for every code
+    int *function_of;
+    char *compilable;
+
+    // Each batch of functions compiled together gets its own mapping
+    char **chunks;
+    int *chunk_sizes;
+    int chunk_count;
+} VMJit;
+
+// Functions calling an external marked async are left to the 
+// interpreter, which can suspend them
+void jit_init(VMJit *jit, const VMProgram *program, 
+    VMFunc *links, const char *async, VMStack *stack);
+
+// Compile a function along with any function it calls that doesn't have 
+// native code yet. Gives -1 if the function has to stay interpreted
+int jit_compile(VMJit *jit, int function);
+void jit_compile_all(VMJit *jit);
+void jit_free(VMJit *jit);
+
+#endif // JIT_H
@@ -0,0 +1,50 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "vm.h"
+#include "program.h"
+#include "stack.h"
+
+// Sampling needs a timer that counts CPU time and signals when it's up
+#if defined(__unix__) || defined(__APPLE__)
+#define PROFILE_SUPPORTED 1
+#else
+#define PROFILE_SUPPORTED 0
+#endif
+
+typedef struct VMProfile
+{
+    volatile int running;
+    int frequency;
+
+    // What's being run on this thread, for the signal handler to walk.
+    // The profiled interpreter loop keeps the instruction up to date,
+    // and clears it while native code runs
+    const VMProgram *volatile program;
+    const VMStack *stack;
+    int entry;
+    const VMInstr *volatile ip;
+
+    // Samples are packed one after the other, as a depth followed by
+    // that many offsets
+    int *buffer;
+    int buffer_size;
+    int used;
+    int dropped;
+
+    VMProfileStats stats;
+} VMProfile;
+
+// Only one profile can be running at a time, as the timer is shared
+// by the whole process
+int profile_start(VMProfile *profile, int frequency);
+void profile_stop(VMProfile *profile);
+void profile_free(VMProfile *profile);
+
+// Samples are only taken while a program is entered on the thread
+// the timer signals
+void profile_enter(VMProfile *profile, const VMProgram *program,
+    const VMStack *stack, int entry);
+void profile_leave(VMProfile *profile);
+
+#endif // PROFILE_H
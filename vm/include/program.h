@@ -0,0 +1,39 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+// A single pre-decoded instruction. Operands are decoded once at load,
+// and jump and call targets are resolved to instruction indices. 
+// CREATE_FRAME's spare operands are filled in by the verifier
+typedef struct VMInstr
+{
+    int op;
+    int a, b, c;
+} VMInstr;
+
+typedef struct VMProgram
+{
+    VMInstr *code;
+    int size;
+
+    // Byte offset of each instruction in the linked code
+    int *offsets;
+
+    // The constant pool followed by inline data for variable sized pushes
+    char *data;
+} VMProgram;
+
+int program_decode(VMProgram *program, const char *code, int size,
+    const char *constants, int constant_size);
+
+// Fuse the instructions from start up to end, which is safe to do even 
+// while that code is running
+void program_fuse(VMProgram *program, int start, int end);
+
+// Gives the first plain code of a fused one, the rest of its sequence 
+// is still in the records that follow
+int program_original_op(int op);
+
+int program_find(const VMProgram *program, int offset);
+void program_free(VMProgram *program);
+
+#endif // PROGRAM_H
@@ -0,0 +1,54 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "vm.h"
+
+// Workers are threads, so this needs pthreads
+#if defined(__unix__) || defined(__APPLE__)
+#define SCHEDULER_SUPPORTED 1
+#else
+#define SCHEDULER_SUPPORTED 0
+#endif
+
+// Runs script calls as fibers across a pool of worker threads. Each
+// worker has its own run queue, taking the newest task from it and
+// stealing the oldest from another worker's when it runs out. A fiber
+// is a context with its own stack, so a call suspended by an async
+// external keeps its fiber until it's woken, and any worker can carry
+// it on. Idle fibers are kept by the worker that last ran them, along
+// with the script they last loaded, so calls into the same code don't
+// load it again
+typedef struct VMScheduler VMScheduler;
+typedef struct VMTask VMTask;
+
+// Called on each new fiber's context to register its externals. Giving
+// it fuel that yields time slices the tasks, as one that runs out goes
+// to the back of its worker's queue
+typedef void (*VMSetup)(VMContext *context);
+
+// Gives NULL if the workers can't be started
+VMScheduler *scheduler_create(int worker_count, int stack_size,
+    VMSetup setup);
+
+// Every task has to have been awaited first
+void scheduler_free(VMScheduler *scheduler);
+
+// Call the function at start in the linked code, which has to stay
+// alive, as does return_value, until the task is awaited. Code is known
+// by where it is, so tasks given the same pointer and size reuse the
+// script a fiber already loaded. Code changed in place, or freed and
+// its memory used for other code, needs a new scheduler
+VMTask *scheduler_submit(VMScheduler *scheduler, const char *code,
+    int size, int start, char *return_value);
+
+// Waits for the task to finish and frees it, giving what vm_call gave
+int scheduler_await(VMTask *task);
+
+// The task running on this thread, for an async external to keep before
+// it suspends. Waking the task once the external's result is written
+// queues it to carry on, which is safe from any thread, even before the
+// external has returned
+VMTask *scheduler_current();
+void scheduler_wake(VMTask *task);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,102 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include "flags.h"
+#include <signal.h>
+
+// Guard pages need mmap, and a signal handler to catch running into them
+#if defined(__unix__) || defined(__APPLE__)
+#define STACK_GUARD 1
+#include <setjmp.h>
+#else
+#define STACK_GUARD 0
+#endif
+
+// Host memory a script can reach through a ref, size bytes from ref
+typedef struct VMView
+{
+    char *data;
+    int ref;
+    int size;
+} VMView;
+
+// Ways of leaving a call through the fault buffer
+enum
+{
+    STACK_OVERFLOW = 1,
+    STACK_BAD_REF = 2,
+    STACK_OUT_OF_HEAP = 3,
+};
+
+// The stack is reserved up front but only backed by memory as it's 
+// touched, and is followed by a guard region that overflowing runs into. 
+// The heap comes after that in the same reservation, with a guard region 
+// of its own, so refs into it are offsets from the stack like any other
+typedef struct VMStack
+{
+    char *memory;
+    int size;
+    int mapped_size;
+
+    // Base pointer of the newest frame, kept up to date by calls and
+    // returns so an overflow can tell how deep it was. The profiler's
+    // signal handler reads it too, so every store has to land in full
+    volatile sig_atomic_t frame;
+
+    // The heap is one region, allocated from by bumping top and freed
+    // all at once by moving it back to the start
+    int heap;
+    int heap_size;
+    int heap_top;
+
+    // Bytes asked for by the last allocation that didn't fit
+    long long heap_request;
+
+    // Views take up refs from the end of the heap's guard region on, 
+    // sorted by ref, so any ref below mapped_size is the stack or heap
+    VMView *views;
+    int view_count;
+    int view_capacity;
+
+    // The last ref that wasn't inside the stack or a view
+    int bad_ref;
+
+#if STACK_GUARD
+    sigjmp_buf fault;
+#endif
+} VMStack;
+
+int stack_create(VMStack *stack, int size, int heap_size);
+void stack_free(VMStack *stack);
+
+// While a stack is entered on a thread, faulting in its guard region 
+// jumps back to its fault buffer with STACK_OVERFLOW
+void stack_enter(VMStack *stack);
+void stack_leave();
+
+// Unblock the fault signals after jumping out of the handler
+void stack_recover();
+int stack_depth(const VMStack *stack);
+
+// Allocate count values of size bytes from the heap, zeroed, giving a 
+// ref to them or -1 if they don't fit
+int stack_new(VMStack *stack, int count, int size);
+void stack_free_heap(VMStack *stack);
+
+// Give host memory the lowest free range of refs that fits it, or -1 if
+// there's no room left below INT_MAX
+int stack_map(VMStack *stack, void *data, int size);
+int stack_unmap(VMStack *stack, int ref);
+
+// Where size bytes from a ref past the guard region are, or NULL if 
+// they aren't all inside one view
+char *stack_view(const VMStack *stack, int ref, int size);
+
+// Native code has no way to stop a call itself, so a bad ref, an 
+// allocation that doesn't fit or calls nested too deep for the host's 
+// stack jump back to the fault buffer
+void stack_bad_ref(VMStack *stack, int ref);
+void stack_out_of_heap(VMStack *stack);
+void stack_overflow(VMStack *stack);
+
+#endif // STACK_H
@@ -1,11 +1,13 @@
 #ifndef STD_H
 #define STD_H
 
-void register_io();
+#include "vm.h"
 
-static void register_std()
+void register_io(VMContext *context);
+
+static void register_std(VMContext *context)
 {
-    register_io();
+    register_io(context);
 }
 
 #endif // STD_H
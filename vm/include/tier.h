@@ -0,0 +1,40 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include "vm.h"
+#include "program.h"
+#include "jit.h"
+
+typedef struct VMTiers
+{
+    VMProgram *program;
+    VMJit *jit;
+
+    // Indexed by the instruction that starts each function. The
+    // interpreter counts into these, and promotes the function once
+    // its calls plus back-edges reach its next threshold. Counts are 
+    // 64 bit so a long running loop can't wrap them, and a function 
+    // with no tier left has a threshold of ULLONG_MAX
+    unsigned long long *calls;
+    unsigned long long *back_edges;
+    unsigned long long *next;
+    char *tiers;
+    int *ends;
+    int fuse_threshold;
+    int jit_threshold;
+
+    VMPromotion *promotions;
+    int promotion_count;
+} VMTiers;
+
+// Back-edge jumps get the start of their function in their b operand,
+// every other jump gets -1
+void tier_init(VMTiers *tiers, VMProgram *program, VMJit *jit,
+    int fuse_threshold, int jit_threshold);
+void tier_promote(VMTiers *tiers, int function);
+
+// Replace the stats with a copy of the counts so far
+void tier_report(const VMTiers *tiers, VMTierStats *stats);
+void tier_free(VMTiers *tiers);
+
+#endif // TIER_H
@@ -0,0 +1,19 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "program.h"
+
+// Checks decoded code once at load, so the interpreter can run it with 
+// no checks of its own. Every operand has to be in bounds, every jump 
+// has to stay in its function, and every instruction has to be reached 
+// with the same stack height on every path, without popping more than 
+// its function pushed. Gives -1 after printing the first problem found.
+//
+// Each CREATE_FRAME record gets the most stack its function uses past 
+// the base pointer in b, and c set if that's more than the guard region 
+// can catch, in which case the frame is checked against the stack size 
+// when it's made
+int verify_program(VMProgram *program, 
+    const int *external_args, int external_count);
+
+#endif // VERIFY_H
@@ -8,11 +8,262 @@ typedef struct VMState
     int bp;
     int depth;
     char *stack;
+
+    // Set by vm_suspend
+    int suspended;
+
+    // Where vm_ref finds the views mapped into the context
+    const struct VMStack *address_space;
 } VMState;
 typedef void (*VMFunc)(VMState *state);
 
-void vm_init();
-void register_external(const char *name, VMFunc func);
-int vm_run(char *code, int start, char *return_value);
+// Where size bytes from a ref an external was given are, whether that's 
+// on the stack, on the heap or in a view of host memory. Gives NULL if 
+// they aren't all in one of them. Heap refs are only valid until the 
+// call from the host returns, as its heap is freed then, and for a 
+// batch before each row
+void *vm_ref(const VMState *state, int ref, int size);
+
+// What vm_run, vm_call and vm_resume give. A pending call was suspended 
+// by an async external and a yielded one ran out of fuel, both are 
+// waiting to be resumed
+typedef enum VMResult
+{
+    VM_ERROR = -1,
+    VM_DONE = 0,
+    VM_PENDING = 1,
+    VM_YIELDED = 2,
+} VMResult;
+
+// Functions start out decoded, and move up a tier each time they get 
+// hot enough. Hotness is the number of calls plus loop back-edges
+typedef enum VMTier
+{
+    VM_TIER_DECODED,
+    VM_TIER_FUSED,
+    VM_TIER_NATIVE,
+} VMTier;
+
+// Only calls and back-edges run by the interpreter are counted, 
+// native code doesn't keep counts
+typedef struct VMFunctionStats
+{
+    int offset;
+    unsigned long long calls;
+    unsigned long long back_edges;
+    VMTier tier;
+} VMFunctionStats;
+
+typedef struct VMPromotion
+{
+    int offset;
+    VMTier tier;
+
+    // Counts at the time, a function compiled because its caller got hot 
+    // may have been promoted with any count
+    unsigned long long calls;
+    unsigned long long back_edges;
+} VMPromotion;
+
+typedef struct VMTierStats
+{
+    int fuse_threshold;
+    int jit_threshold;
+
+    int function_count;
+    VMFunctionStats *functions;
+
+    int promotion_count;
+    VMPromotion *promotions;
+} VMTierStats;
+
+// A call chain sampled by the profiler, as code offsets from the 
+// innermost frame out. The first is the instruction that was running, 
+// or the start of its function if that was native code, and each one 
+// after is the call the frame before it was made from
+typedef struct VMSample
+{
+    int depth;
+    const int *offsets;
+} VMSample;
+
+typedef struct VMProfileStats
+{
+    int frequency;
+    int sample_count;
+    VMSample *samples;
+
+    // Samples that didn't fit in the profile's buffer
+    int dropped;
+} VMProfileStats;
+
+// Everything a VM needs to run lives in its context, so separate
+// contexts can run on separate threads without sharing any state. A
+// context runs one script at a time, and linked code is only read from,
+// so the same code can be run by many contexts at once
+typedef struct VMContext VMContext;
+
+// The stack is reserved with room for stack_size bytes, but memory is
+// only used as it's needed. Running out gives an error instead of
+// writing past the end. Gives NULL if it can't be reserved
+VMContext *vm_create(int stack_size);
+void vm_free(VMContext *context);
+void register_external(VMContext *context, const char *name, VMFunc func);
+
+// An async external can suspend the call it's running in rather than 
+// block, such as while it waits on I/O. It pops its args as usual and 
+// calls vm_suspend, and the call gives VM_PENDING straight back to the 
+// host. The stack never moves, so the external can keep where its 
+// return value goes and the host fills it in before vm_resume carries 
+// on from the next instruction. Functions calling async externals are 
+// never compiled to native code, as that can't be suspended
+void register_async_external(VMContext *context, const char *name, 
+    VMFunc func);
+void vm_suspend(VMState *state);
+
+// While a call is suspended its context's stack holds it, so the 
+// context can't start another call until it's finished. A thread can 
+// run many scripts waiting on I/O by giving each its own context. A 
+// call started by vm_run is unloaded once a resume finishes it
+int vm_resume(VMContext *context, char *return_value);
+
+// A script is linked code loaded into a context, decoded and linked once
+// so it can be called any number of times. Each call starts from an
+// empty stack, and hot functions stay promoted between calls
+typedef struct VMScript VMScript;
+
+VMScript *vm_load(VMContext *context, const char *code, int size);
+int vm_call(VMScript *script, int start, char *return_value);
+void vm_unload(VMScript *script);
+
+// A function the code exports, with the sizes a call to it lays out on
+// the stack. Names are mangled with their param types, such as
+// "fib.add(int, float)", and functions without params are just "fib.main"
+typedef struct VMFunction
+{
+    const char *name;
+    int offset;
+    int arg_size;
+    int return_size;
+
+    // Such as "int", or "null" if it returns nothing. NULL if the code
+    // is too old to say
+    const char *return_type;
+
+    // Where it starts in the decoded program
+    int start_index;
+} VMFunction;
+
+// Exports are hashed by name when loaded, so finding one doesn't
+// depend on how many there are. Gives NULL or -1 if there isn't one,
+// and the entry function is -1 if the code wasn't linked with one
+const VMFunction *vm_get_function(const VMScript *script,
+    const char *name);
+int vm_find_function(const VMScript *script, const char *name);
+int vm_entry(const VMScript *script);
+
+// vm_call only starts functions without args. For one with args, begin
+// the call, push each arg in the order the function declares them,
+// then invoke it, which gives what vm_call would. Args are written
+// straight into the stack where the function's frame will find them,
+// and the call fails if they don't add up to its arg size
+int vm_begin_call(VMScript *script, const VMFunction *function);
+void vm_push_int(VMScript *script, int value);
+void vm_push_float(VMScript *script, float value);
+void vm_push_char(VMScript *script, char value);
+void vm_push_bool(VMScript *script, int value);
+void vm_push_data(VMScript *script, const void *data, int size);
+int vm_invoke(VMScript *script, char *return_value);
+
+// Instead of pushing them one at a time, a host can write all of the
+// args itself. Gives where they go, arg_size bytes laid out as the
+// compiler pushes them, so the last arg comes first and the first is
+// at the end. NULL if no call was begun or args were already pushed
+char *vm_arg_data(VMScript *script);
+
+// Values of one param for every row of a batch, size bytes each
+typedef struct VMColumn
+{
+    const void *data;
+    int size;
+} VMColumn;
+
+// Call a function once for each row, taking its args from the columns, 
+// one for each param in the order they're declared, and writing each 
+// row's return value one after the other into results, which can be 
+// NULL. Every row runs within the one call, starting again from the 
+// top as the last one returns, so a row costs little more than the 
+// function itself. Gives what the call gave, and an error stops at the 
+// row that hit it. A pending or yielded batch carries on through 
+// vm_resume, and fuel is shared by all of its rows. The data in the 
+// columns and the results have to stay alive until it's finished
+int vm_call_batch(VMScript *script, const VMFunction *function, 
+    const VMColumn *columns, int column_count, int row_count, 
+    char *results);
+
+// The row the last batch got to, which is its row count once finished
+int vm_batch_row(const VMScript *script);
+
+// Where a code offset came from, which is only known if the code was
+// linked with its debug section. Gives -1 if it can't be found
+typedef struct VMSourcePosition
+{
+    const char *function;
+    const char *file;
+    int line;
+    int column;
+} VMSourcePosition;
+
+int vm_find_source(const VMScript *script, int offset, 
+    VMSourcePosition *position);
+
+// Give each call fuel, charged one for every call and every jump back 
+// to the top of a loop, or 0 for no limit. A call that runs out either 
+// yields, giving VM_YIELDED so the host can resume it later with fresh 
+// fuel, or stops with an error. A stack limit stops any call that would 
+// make a frame reaching past it. Calls with either run in a copy of the 
+// interpreter loop that checks them and doesn't run native code, so 
+// calls without them cost nothing extra. Limits take the place of 
+// profiling while both are on
+void vm_set_fuel(VMContext *context, int fuel, int yield);
+void vm_set_stack_limit(VMContext *context, int size);
+
+// Host memory can be mapped into a context as a view, so scripts read 
+// and write it in place through a ref, such as an int ref param indexed 
+// like an array, without it being copied onto the stack. Views are given 
+// refs past the end of the stack, and every load and store through one 
+// is checked against its size, stopping the call with an error if it 
+// reaches outside. Gives the ref to pass in, or -1 if there's no room. 
+// The memory has to stay alive until it's unmapped or the context freed
+int vm_map(VMContext *context, void *data, int size);
+void vm_unmap(VMContext *context, int ref);
+
+// Load, call once, then unload
+int vm_run(VMContext *context, const char *code, int size, 
+    int start, char *return_value);
+
+// Thresholds apply to scripts loaded after, stats are for the last
+// script unloaded
+void vm_set_tier_thresholds(VMContext *context, 
+    int fuse_threshold, int jit_threshold);
+const VMTierStats *vm_tier_stats(const VMContext *context);
+
+// Sample what the context is running frequency times a second of CPU 
+// time, until stopped. Only one context can be profiled at a time, and 
+// contexts that aren't being profiled run the loop with no sampling 
+// hooks at all. Stats are for the last profile stopped
+int vm_profile_start(VMContext *context, int frequency);
+void vm_profile_stop(VMContext *context);
+const VMProfileStats *vm_profile_stats(const VMContext *context);
+
+// Run calls with a counting copy of the interpreter loop, which counts 
+// every opcode it runs, every pair of opcodes run one after the other 
+// and every call to an external. It doesn't run native code, so all of 
+// a call is counted. Counts add up over calls until stopped, and are 
+// written as JSON, also by vm_run when it finishes if given a path. 
+// Counting takes the place of profiling while both are on
+void vm_counts_start(VMContext *context, const char *path);
+void vm_counts_stop(VMContext *context);
+int vm_counts_write(const VMContext *context, const char *path);
 
 #endif // VM_H
@@ -1,42 +1,77 @@
 #include "bytecode.h"
+#include "debug.h"
+#include "format.h"
 #include <stdio.h>
+#include <memory.h>
 
-static int decode_header(char *data)
+// Exports from version 2 on follow each name with a return type
+static void print_names(const VMSection *section, const char *format, 
+    int typed)
 {
-    int pc = 0, i, j;
-    int external_count = data[pc++];
-    char name[80];
+    VMReader reader;
+    int i, length, type_length = 4;
 
-    for (i = 0; i < external_count; i++)
+    format_reader(&reader, section);
+    int count = format_read_int(&reader);
+    for (i = 0; i < count && !reader.error; i++)
     {
-        int id = *(int*)(data + pc); pc += 4;
-        int name_len = data[pc++];
-        for (j = 0; j < name_len; j++)
-            name[j] = data[pc++];
-        name[name_len] = '\0';
-        printf("External '%s' with id %i\n", name, id);
+        int value = format_read_int(&reader);
+        const char *name = format_read_name(&reader, &length);
+        const char *type = "null";
+        if (typed)
+            type = format_read_name(&reader, &type_length);
+        if (!reader.error)
+            printf(format, length, name, i, value, type_length, type);
     }
-
-    return pc;
 }
 
-void disassemble(char *code, int size)
+void disassemble(char *data, int size)
 {
-    int i = decode_header(code);
-    int j = 0;
-    int start = i;
+    int i = 0, j = 0;
+    VMFormat format;
+    VMDebug debug;
+
+    if (format_read(&format, data, size))
+        return;
+
+    print_names(&format.sections[VM_SECTION_IMPORTS], 
+        "External '%.*s' in slot %i, %ib of args\n", 0);
+    print_names(&format.sections[VM_SECTION_EXPORTS], 
+        format.version >= 2 ? "Function '%.*s' (%i) at %i -> %.*s\n" : 
+        "Function '%.*s' (%i) at %i\n", format.version >= 2);
+    printf("Entry at %i, %ib of constants\n", format.entry, 
+        format.sections[VM_SECTION_CONSTANTS].size);
 
-    printf("%i / %i\n", start, size);
+    // Label functions and source lines where they start, if the code 
+    // has a debug section
+    const VMSection *debug_section = &format.sections[VM_SECTION_DEBUG];
+    if (debug_decode(&debug, debug_section->data, debug_section->size))
+        debug_decode(&debug, NULL, 0);
+
+    const char *code = format.sections[VM_SECTION_CODE].data;
+    const VMDebugLine *last_line = NULL;
+    size = format.sections[VM_SECTION_CODE].size;
+    printf("%ib of code\n", size);
     while (i < size)
     {
-        int bytecode = code[i++];
+        const VMDebugFunction *function = debug_find_function(&debug, i);
+        const VMDebugLine *line = debug_find_line(&debug, i);
+        if (function != NULL && function->start == i)
+            printf("\n%s:\n", function->name);
+        if (line != NULL && line != last_line)
+            printf("    ; %s:%i\n", debug.files[line->file], line->line);
+        last_line = line;
+
+        int bytecode = (unsigned char)code[i++];
         int code_size = bytecode_size[bytecode];
         if (code_size == -1)
             code_size = code[i++];
 
-        printf("%i  %s (", i - start - 1, bytecode_names[bytecode]);
+        printf("%i  %s (", i - 1, bytecode_names[bytecode]);
         for (j = 0; j < code_size; j++)
             printf("%i%s", code[i++], j == code_size-1 ? "" : ", ");
         printf(")\n");
     }
+
+    debug_free(&debug);
 }
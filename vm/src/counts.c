@@ -0,0 +1,135 @@
+#include "counts.h"
+#include <stdlib.h>
+#include <memory.h>
+
+typedef struct CountEntry
+{
+    long long count;
+    int index;
+} CountEntry;
+
+void counts_start(VMCounts *counts, int external_size)
+{
+    if (counts->opcodes == NULL)
+    {
+        counts->opcodes = malloc(BC_COUNT * sizeof(long long));
+        counts->pairs = malloc(BC_COUNT * BC_COUNT * sizeof(long long));
+    }
+
+    memset(counts->opcodes, 0, BC_COUNT * sizeof(long long));
+    memset(counts->pairs, 0, BC_COUNT * BC_COUNT * sizeof(long long));
+    if (counts->externals != NULL)
+        memset(counts->externals, 0, counts->external_size * sizeof(long long));
+    counts_reserve(counts, external_size);
+    counts->last_op = BC_SIZE;
+    counts->running = 1;
+}
+
+void counts_stop(VMCounts *counts)
+{
+    counts->running = 0;
+}
+
+void counts_free(VMCounts *counts)
+{
+    free(counts->opcodes);
+    free(counts->pairs);
+    free(counts->externals);
+    memset(counts, 0, sizeof(VMCounts));
+}
+
+void counts_reserve(VMCounts *counts, int external_size)
+{
+    if (external_size <= counts->external_size)
+        return;
+
+    counts->externals = realloc(counts->externals, 
+        external_size * sizeof(long long));
+    memset(counts->externals + counts->external_size, 0, 
+        (external_size - counts->external_size) * sizeof(long long));
+    counts->external_size = external_size;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const CountEntry *left = a, *right = b;
+    if (left->count != right->count)
+        return left->count < right->count ? 1 : -1;
+    return left->index - right->index;
+}
+
+// Gives the non zero counts sorted highest first, to be freed after
+static CountEntry *sort_counts(const long long *values, int size, int *count)
+{
+    CountEntry *entries = malloc((size ? size : 1) * sizeof(CountEntry));
+    int i;
+
+    *count = 0;
+    for (i = 0; i < size; i++)
+    {
+        if (values[i] != 0)
+        {
+            entries[*count].count = values[i];
+            entries[*count].index = i;
+            *count += 1;
+        }
+    }
+
+    qsort(entries, *count, sizeof(CountEntry), compare_entries);
+    return entries;
+}
+
+static void write_string(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', file);
+        if ((unsigned char)*str >= ' ')
+            fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+void counts_write(const VMCounts *counts, FILE *file, 
+    const char *const *external_names)
+{
+    long long dispatches = 0;
+    int i, count;
+
+    for (i = 0; i < BC_COUNT; i++)
+        dispatches += counts->opcodes[i];
+    fprintf(file, "{\n  \"dispatches\": %lli,\n  \"opcodes\": [", dispatches);
+
+    CountEntry *entries = sort_counts(counts->opcodes, BC_COUNT, &count);
+    for (i = 0; i < count; i++)
+    {
+        fprintf(file, "%s\n    {\"opcode\": \"%s\", \"count\": %lli}", 
+            i ? "," : "", bytecode_names[entries[i].index], entries[i].count);
+    }
+    free(entries);
+
+    fprintf(file, "\n  ],\n  \"pairs\": [");
+    entries = sort_counts(counts->pairs, BC_COUNT * BC_COUNT, &count);
+    for (i = 0; i < count; i++)
+    {
+        fprintf(file, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", "
+            "\"count\": %lli}", i ? "," : "", 
+            bytecode_names[entries[i].index / BC_COUNT], 
+            bytecode_names[entries[i].index % BC_COUNT], entries[i].count);
+    }
+    free(entries);
+
+    fprintf(file, "\n  ],\n  \"externals\": [");
+    entries = sort_counts(counts->externals, counts->external_size, &count);
+    for (i = 0; i < count; i++)
+    {
+        fprintf(file, "%s\n    {\"name\": ", i ? "," : "");
+        write_string(file, external_names[entries[i].index]);
+        fprintf(file, ", \"count\": %lli}", entries[i].count);
+    }
+    free(entries);
+
+    fprintf(file, "\n  ]\n}\n");
+}
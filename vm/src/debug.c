@@ -0,0 +1,189 @@
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#define DEBUG_VERSION 1
+
+typedef struct DebugReader
+{
+    const unsigned char *data;
+    int size;
+    int pos;
+    int error;
+} DebugReader;
+
+static unsigned int read_uleb(DebugReader *reader)
+{
+    unsigned int value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do
+    {
+        if (reader->pos >= reader->size || shift > 28)
+        {
+            reader->error = 1;
+            return 0;
+        }
+
+        byte = reader->data[reader->pos++];
+        value |= (unsigned int)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+static int read_sleb(DebugReader *reader)
+{
+    int value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do
+    {
+        if (reader->pos >= reader->size || shift > 28)
+        {
+            reader->error = 1;
+            return 0;
+        }
+
+        byte = reader->data[reader->pos++];
+        value |= (byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    if (shift < 32 && (byte & 0x40))
+        value |= -(1 << shift);
+    return value;
+}
+
+static char *read_name(DebugReader *reader)
+{
+    unsigned int length = read_uleb(reader);
+    if (reader->error || length > (unsigned int)(reader->size - reader->pos))
+    {
+        reader->error = 1;
+        return NULL;
+    }
+
+    char *name = malloc(length + 1);
+    memcpy(name, reader->data + reader->pos, length);
+    name[length] = '\0';
+    reader->pos += length;
+    return name;
+}
+
+// Counts are checked against the bytes left, as every entry takes at
+// least one, so a bad count can't ask for a huge allocation
+static int read_count(DebugReader *reader)
+{
+    unsigned int count = read_uleb(reader);
+    if (count > (unsigned int)(reader->size - reader->pos))
+        reader->error = 1;
+    return reader->error ? 0 : (int)count;
+}
+
+int debug_decode(VMDebug *debug, const char *data, int size)
+{
+    DebugReader reader = { (const unsigned char*)data, size, 0, 0 };
+    int i;
+
+    memset(debug, 0, sizeof(VMDebug));
+    if (size == 0)
+        return 0;
+
+    if (data[reader.pos++] != DEBUG_VERSION)
+    {
+        printf("Error: Unknown debug section version %i\n", data[0]);
+        return -1;
+    }
+
+    debug->file_count = read_count(&reader);
+    debug->files = calloc(debug->file_count, sizeof(char*));
+    for (i = 0; i < debug->file_count && !reader.error; i++)
+        debug->files[i] = read_name(&reader);
+
+    int end = 0;
+    debug->function_count = read_count(&reader);
+    debug->functions = calloc(debug->function_count, sizeof(VMDebugFunction));
+    for (i = 0; i < debug->function_count && !reader.error; i++)
+    {
+        VMDebugFunction *function = &debug->functions[i];
+        function->start = end + read_uleb(&reader);
+        function->end = function->start + read_uleb(&reader);
+        function->name = read_name(&reader);
+        end = function->end;
+    }
+
+    int offset = 0, line = 0;
+    debug->line_count = read_count(&reader);
+    debug->lines = calloc(debug->line_count, sizeof(VMDebugLine));
+    for (i = 0; i < debug->line_count && !reader.error; i++)
+    {
+        VMDebugLine *row = &debug->lines[i];
+        offset += read_uleb(&reader);
+        row->offset = offset;
+        row->file = read_uleb(&reader);
+        line += read_sleb(&reader);
+        row->line = line;
+        row->column = read_uleb(&reader);
+        if (row->file >= debug->file_count)
+            reader.error = 1;
+    }
+
+    if (reader.error)
+    {
+        printf("Error: Invalid debug section\n");
+        debug_free(debug);
+        return -1;
+    }
+
+    return 0;
+}
+
+const VMDebugFunction *debug_find_function(const VMDebug *debug, int offset)
+{
+    int low = 0, high = debug->function_count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        const VMDebugFunction *function = &debug->functions[middle];
+        if (offset < function->start)
+            high = middle - 1;
+        else if (offset >= function->end)
+            low = middle + 1;
+        else
+            return function;
+    }
+
+    return NULL;
+}
+
+const VMDebugLine *debug_find_line(const VMDebug *debug, int offset)
+{
+    // Find the last row starting at or before the offset
+    int low = 0, high = debug->line_count;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (debug->lines[middle].offset <= offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low > 0 ? &debug->lines[low - 1] : NULL;
+}
+
+void debug_free(VMDebug *debug)
+{
+    int i;
+    for (i = 0; i < debug->file_count; i++)
+        free(debug->files[i]);
+    for (i = 0; i < debug->function_count; i++)
+        free(debug->functions[i].name);
+    free(debug->files);
+    free(debug->functions);
+    free(debug->lines);
+    memset(debug, 0, sizeof(VMDebug));
+}
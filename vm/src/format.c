@@ -0,0 +1,99 @@
+#include "format.h"
+#include <stdio.h>
+#include <memory.h>
+
+#define HEADER_SIZE 16
+#define ENTRY_SIZE 12
+
+static int read_int_at(const char *data, int at)
+{
+    int value;
+    memcpy(&value, data + at, 4);
+    return value;
+}
+
+int format_read(VMFormat *format, const char *data, int size)
+{
+    int i;
+
+    memset(format, 0, sizeof(VMFormat));
+    if (size < HEADER_SIZE || memcmp(data, VM_FORMAT_MAGIC, 4))
+    {
+        printf("Error: Not TinyVM code\n");
+        return -1;
+    }
+
+    format->version = read_int_at(data, 4);
+    format->entry = read_int_at(data, 8);
+    if (format->version < 1 || format->version > VM_FORMAT_VERSION)
+    {
+        printf("Error: Unsupported code version %i\n", format->version);
+        return -1;
+    }
+
+    int count = read_int_at(data, 12);
+    if (count < 0 || count > (size - HEADER_SIZE) / ENTRY_SIZE)
+    {
+        printf("Error: Invalid section count %i\n", count);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        const char *entry = data + HEADER_SIZE + i * ENTRY_SIZE;
+        int kind = read_int_at(entry, 0);
+        int offset = read_int_at(entry, 4);
+        int section_size = read_int_at(entry, 8);
+        if (offset < 0 || section_size < 0 || offset > size || 
+            section_size > size - offset)
+        {
+            printf("Error: Section %i is outside of the code\n", kind);
+            return -1;
+        }
+
+        // Sections from newer versions are skipped
+        if (kind <= 0 || kind >= VM_SECTION_COUNT)
+            continue;
+
+        format->sections[kind].data = data + offset;
+        format->sections[kind].size = section_size;
+    }
+
+    return 0;
+}
+
+void format_reader(VMReader *reader, const VMSection *section)
+{
+    reader->data = section->data;
+    reader->size = section->size;
+    reader->pos = 0;
+    reader->error = 0;
+}
+
+int format_read_int(VMReader *reader)
+{
+    if (reader->error || reader->size - reader->pos < 4)
+    {
+        reader->error = 1;
+        return 0;
+    }
+
+    int value = read_int_at(reader->data, reader->pos);
+    reader->pos += 4;
+    return value;
+}
+
+const char *format_read_name(VMReader *reader, int *length)
+{
+    *length = format_read_int(reader);
+    if (reader->error || *length < 0 || *length > reader->size - reader->pos)
+    {
+        reader->error = 1;
+        *length = 0;
+        return NULL;
+    }
+
+    const char *name = reader->data + reader->pos;
+    reader->pos += *length;
+    return name;
+}
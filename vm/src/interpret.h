@@ -0,0 +1,338 @@
+// The interpreter loop, which vm.c includes once for each variant of it.
+// INTERPRET names the function, PROFILE_IP and PROFILE_NATIVE are the 
+// profiler's hooks, COUNT_OP and COUNT_EXTERNAL are the counters, 
+// CHARGE_CALL and CHARGE_BACK_EDGE check the budget, HAS_BUDGET says 
+// whether the loop has a budget at all, and RUN_NATIVE says whether 
+// compiled functions run as native code. The fast loop defines every 
+// hook as nothing
+// Starts from the top of a call, or carries on from where it was 
+// suspended if given the registers it stopped with
+static int INTERPRET(VMScript *script, int start_index, 
+    const VMState *resume, char *return_value)
+{
+    VMContext *context = script->context;
+    VMProgram *program = &script->program;
+    VMFunc *links = script->links;
+
+#if JIT_SUPPORTED
+    VMJit *jit = &script->jit;
+    VMNative *natives = jit->natives;
+
+    // Any thread can run the script, so native calls are bounded by the 
+    // stack of the one running it now
+    jit->host_floor = (char*)__builtin_frame_address(0) - jit->host_budget;
+#endif
+
+#if VM_TIERED
+    VMTiers *tiers = &script->tiers;
+#endif
+
+    // Keep the hot registers in locals, as the state struct escapes to 
+    // externals and would otherwise be reloaded from memory every opcode
+    VMState s;
+    VMInstr *code = program->code;
+    VMInstr *ip = code + start_index;
+    const VMInstr *in;
+    int sp = 0;
+    int bp = 0;
+    int depth = 0;
+    int result = 0;
+    char *stack = context->stack.memory;
+    unsigned int view_base = context->stack.mapped_size;
+
+    // Only loops with budget hooks use these
+#if HAS_BUDGET
+    long long fuel = context->fuel > 0 ? context->fuel : LLONG_MAX;
+    int stack_limit = context->stack_limit > 0 ? 
+        context->stack_limit : context->stack.size;
+#endif
+
+    // Running into the guard region lands back here, where every local 
+    // still needed was set before the jump could happen. The signal mask 
+    // isn't saved, as that costs a system call every time
+    stack_enter(&context->stack);
+#if STACK_GUARD
+    switch (sigsetjmp(context->stack.fault, 0))
+    {
+        case 0:
+            break;
+        case STACK_OVERFLOW:
+            stack_recover();
+            goto overflow;
+        case STACK_OUT_OF_HEAP:
+            goto native_out_of_heap;
+        default:
+            stack_recover();
+            goto native_bad_ref;
+    }
+#endif
+
+    // Lay the stack out as if the entry function had been called, with 
+    // room for its return value, the args already given and a return 
+    // index, so its frame is the same as any other and it can return 
+    // from native code
+    int return_size = script->last_return_size;
+    sp = return_size + script->last_arg_size + 4;
+    s.suspended = 0;
+
+    if (resume != NULL)
+    {
+        ip = code + resume->pc;
+        sp = resume->sp;
+        bp = resume->bp;
+        depth = resume->depth;
+        context->stack.frame = bp;
+    }
+#if JIT_SUPPORTED
+    else if (RUN_NATIVE && natives[start_index])
+    {
+        PROFILE_NATIVE();
+        natives[start_index](stack, sp, bp, jit);
+        goto native_return;
+    }
+#endif
+
+#if THREADED
+    static const void *dispatch_table[] = 
+    {
+        FOR_EACH_CODE(GENERATE_LABEL)
+        FOR_EACH_FUSED(GENERATE_FUSED_LABEL)
+    };
+
+    DISPATCH();
+#else
+    int running = 1;
+    while (running)
+    {
+        LOG("%i: ", (int)(ip - code));
+
+        in = ip++;
+        PROFILE_IP();
+        COUNT_OP();
+        switch(in->op)
+        {
+#endif
+            HANDLER(BC_PUSH_1)
+            HANDLER(BC_PUSH_4)
+            HANDLER(BC_PUSH_X)
+            HANDLER(BC_POP)
+            HANDLER(BC_ALLOC)
+            HANDLER(BC_STORE_LOCAL_4)
+            HANDLER(BC_STORE_LOCAL_X)
+            HANDLER(BC_LOAD_LOCAL_4)
+            HANDLER(BC_LOAD_LOCAL_X)
+            HANDLER(BC_STORE_LOCAL_1)
+            HANDLER(BC_STORE_LOCAL_8)
+            HANDLER(BC_LOAD_LOCAL_1)
+            HANDLER(BC_LOAD_LOCAL_8)
+            HANDLER(BC_LOCAL_REF)
+            HANDLER(BC_COPY)
+            HANDLER(BC_GET_ARRAY_INDEX)
+            HANDLER(BC_GET_ATTR)
+            HANDLER(BC_ASSIGN_REF_X)
+            HANDLER(BC_CREATE_FRAME)
+            HANDLER(BC_CALL)
+            HANDLER(BC_JUMP)
+            HANDLER(BC_JUMP_IF_NOT)
+            HANDLER(BC_MOVE_1)
+            HANDLER(BC_MOVE_4)
+            HANDLER(BC_MOVE_X)
+            HANDLER(BC_MOVE_CONST_1)
+            HANDLER(BC_MOVE_CONST_4)
+            HANDLER(BC_JUMP_IF_NOT_R)
+            HANDLER(BC_NEW)
+
+            CASE(BC_CALL_EXTERNAL)
+                LOG("call external function %i\n", in->a);
+                s.pc = ip - code; s.sp = sp; s.bp = bp; 
+                s.depth = depth; s.stack = stack;
+                s.address_space = &context->stack;
+                COUNT_EXTERNAL();
+                links[in->a](&s);
+                sp = s.sp;
+                if (s.suspended)
+                    goto suspend;
+                NEXT;
+            
+            CASE(BC_RETURN)
+            {
+                LOG("Return size %i with arg size %i\n", in->a, in->b);
+                int return_size = in->a;
+                int arg_size = in->b;
+                if (depth <= 0)
+                {
+                    if (return_value != NULL)
+                        memcpy(return_value, stack + sp - return_size, return_size);
+
+                    // The next row of a batch starts again from the top
+                    if (batch_next(script, &return_value))
+                    {
+                        sp = script->last_return_size + 
+                            script->last_arg_size + 4;
+                        bp = 0;
+#if JIT_SUPPORTED
+                        if (RUN_NATIVE && natives[start_index])
+                            goto native_row;
+#endif
+                        ip = code + start_index;
+                        NEXT;
+                    }
+                    HALT;
+                }
+
+                // Copy return value into correct slot
+                memcpy(stack + bp - 8 - arg_size - return_size, 
+                    stack + sp - return_size, return_size); 
+                sp -= return_size;
+
+                int return_index;
+                sp = bp;
+                memcpy(&bp, stack + sp - 4, 4); sp -= 4;
+                memcpy(&return_index, stack + sp - 4, 4); sp -= 4;
+                context->stack.frame = bp;
+                sp -= arg_size;
+                ip = code + return_index;
+                depth--;
+                NEXT;
+            }
+
+            OPERATION_SET(INT_INT, int, int, int)
+            OPERATION_SET(INT_FLOAT, int, float, float)
+            OPERATION_SET(INT_CHAR, int, char, int)
+            OPERATION_SET(FLOAT_INT, float, int, float)
+            OPERATION_SET(FLOAT_FLOAT, float, float, float)
+            OPERATION_SET(FLOAT_CHAR, float, char, float)
+            OPERATION_SET(CHAR_INT, char, int, int)
+            OPERATION_SET(CHAR_FLOAT, char, float, float)
+            OPERATION_SET(CHAR_CHAR, char, char, char)
+            CAST_SET(INT, int)
+            CAST_SET(FLOAT, float)
+            CAST_SET(CHAR, char)
+            CAST_SET(BOOL, char)
+            REG_OPERATION_SET(INT_INT, int, int, int)
+            REG_OPERATION_SET(INT_FLOAT, int, float, float)
+            REG_OPERATION_SET(INT_CHAR, int, char, int)
+            REG_OPERATION_SET(FLOAT_INT, float, int, float)
+            REG_OPERATION_SET(FLOAT_FLOAT, float, float, float)
+            REG_OPERATION_SET(FLOAT_CHAR, float, char, float)
+            REG_OPERATION_SET(CHAR_CHAR, char, char, char)
+            IMM_OPERATION_SET(INT_INT, int, int)
+            FOR_EACH_FUSED(GENERATE_FUSED_HANDLER)
+
+            // Opcodes are checked when decoded, and wide locals, wide 
+            // sizes and constants are decoded to other forms, so these 
+            // can't be reached
+            CASE(BC_STORE_LOCAL_W)
+            CASE(BC_LOAD_LOCAL_W)
+            CASE(BC_LOCAL_REF_W)
+            CASE(BC_POP_W)
+            CASE(BC_ALLOC_W)
+            CASE(BC_COPY_W)
+            CASE(BC_RETURN_W)
+            CASE(BC_PUSH_CONST)
+            CASE(BC_SIZE)
+            DEFAULT
+                printf("Error: Unkown bytecode %i\n", in->op); 
+                print_source(script, program->offsets[in - code]);
+                HALT;
+#if THREADED
+halt:
+#else
+        }
+
+        LOG_STACK();
+    }
+#endif
+
+#if JIT_SUPPORTED
+    goto done;
+
+    // Native code leaves the entry function's return value at the 
+    // bottom of the stack. A batch whose function is native runs the 
+    // rest of its rows from here
+native_row:
+    PROFILE_NATIVE();
+    natives[start_index](stack, return_size + script->last_arg_size + 4, 
+        0, jit);
+native_return:
+    if (return_value != NULL)
+        memcpy(return_value, stack, return_size);
+    if (batch_next(script, &return_value))
+        goto native_row;
+#endif
+    goto done;
+
+    // An async external suspended the call. The registers are all that 
+    // isn't already on the stack
+suspend:
+    result = VM_PENDING;
+#if HAS_BUDGET
+save_registers:
+#endif
+    context->resume.pc = ip - code;
+    context->resume.sp = sp;
+    context->resume.bp = bp;
+    context->resume.depth = depth;
+    context->resume.stack = stack;
+    goto done;
+
+#if HAS_BUDGET
+    // Fuel ran out at a call or back-edge, which can be resumed like a 
+    // suspended call, or a call would make a frame past the stack limit
+out_of_budget:
+    if (fuel < 0 && context->fuel_yields)
+    {
+        result = VM_YIELDED;
+        goto save_registers;
+    }
+
+    if (fuel < 0)
+        printf("Error: Ran out of fuel at call depth %i\n", depth);
+    else
+        printf("Error: Stack limit of %i bytes reached at call depth %i\n", 
+            stack_limit, depth + 1);
+    print_source(script, program->offsets[ip - code]);
+    result = -1;
+    goto done;
+#endif
+
+    // A load or store through a ref outside the stack and every view. 
+    // Native code doesn't keep the instruction, so give its caller
+#if STACK_GUARD
+native_bad_ref:
+    ip = NULL;
+#endif
+bad_ref:
+    printf("Error: Ref %i is outside the stack and every view\n", 
+        context->stack.bad_ref);
+    print_source(script, ip != NULL ? 
+        program->offsets[ip - 1 - code] : newest_call(script));
+    result = -1;
+    goto done;
+
+    // An allocation didn't fit in what's left of the heap
+#if STACK_GUARD
+native_out_of_heap:
+    ip = NULL;
+#endif
+out_of_heap:
+    printf("Error: Can't allocate %lld bytes from the heap\n", 
+        context->stack.heap_request);
+    print_source(script, ip != NULL ? 
+        program->offsets[ip - 1 - code] : newest_call(script));
+    result = -1;
+    goto done;
+
+    // Reached from the guard region's handler, or a frame too big for 
+    // the guard to catch
+overflow:
+    printf("Error: Stack overflow at call depth %i\n", 
+        stack_depth(&context->stack));
+    print_source(script, newest_call(script));
+    result = -1;
+
+done:
+    stack_leave();
+
+    return result;
+}
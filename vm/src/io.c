@@ -28,25 +28,36 @@ static void log_bool(VMState *state)
 
 static void log_raw_string(VMState *state)
 {
-    int ref = *(char*)(state->stack + state->sp - 4);
-    int len = *(char*)(state->stack + state->sp - 8);
-    printf("%s\n", state->stack + ref);
+    int ref = *(int*)(state->stack + state->sp - 4);
+    int len = *(int*)(state->stack + state->sp - 8);
+    const char *str = vm_ref(state, ref, len);
     state->sp -= 8;
+    if (str == NULL)
+    {
+        printf("Error: Can't log a string outside the stack, heap or a view\n");
+        return;
+    }
+    printf("%.*s\n", len, str);
 }
 
 #define LOG_ARRAY_FUNC(name, type, printfunc) \
     static void name(VMState *state) \
     { \
-        int ref = *(char*)(state->stack + state->sp - 4); \
-        int len = *(char*)(state->stack + state->sp - 8); \
+        int ref = *(int*)(state->stack + state->sp - 4); \
+        int len = *(int*)(state->stack + state->sp - 8); \
+        const type *values = vm_ref(state, ref, len * (int)sizeof(type)); \
+        state->sp -= 8; \
+        if (values == NULL) \
+        { \
+            printf("Error: Can't log an array outside the stack, heap or a view\n"); \
+            return; \
+        } \
         printf("["); \
         for (int i = 0; i < len; i++) \
         { \
-            printf(printfunc "%s", *(type*)(state->stack + ref + i * sizeof(type)), \
-                i == len-1 ? "" : ", "); \
+            printf(printfunc "%s", values[i], i == len-1 ? "" : ", "); \
         } \
         printf("]\n"); \
-        state->sp -= 8; \
     }
 
 LOG_ARRAY_FUNC(log_int_array, int, "%i")
@@ -54,14 +65,14 @@ LOG_ARRAY_FUNC(log_float_array, float, "%.06g")
 LOG_ARRAY_FUNC(log_bool_array, char, "%i")
 
 
-void register_io()
+void register_io(VMContext *context)
 {
-    register_external("io.log(int)", log_int);
-    register_external("io.log(float)", log_float);
-    register_external("io.log(char)", log_char);
-    register_external("io.log(bool)", log_bool);
-    register_external("io.log(int ref, int)", log_int_array);
-    register_external("io.log(float ref, int)", log_float_array);
-    register_external("io.log(char ref, int)", log_raw_string);
-    register_external("io.log(bool ref, int)", log_bool_array);
+    register_external(context, "io.log(int)", log_int);
+    register_external(context, "io.log(float)", log_float);
+    register_external(context, "io.log(char)", log_char);
+    register_external(context, "io.log(bool)", log_bool);
+    register_external(context, "io.log(int ref, int)", log_int_array);
+    register_external(context, "io.log(float ref, int)", log_float_array);
+    register_external(context, "io.log(char ref, int)", log_raw_string);
+    register_external(context, "io.log(bool ref, int)", log_bool_array);
 }
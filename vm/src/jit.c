@@ -0,0 +1,893 @@
+#include "jit.h"
+#include "bytecode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <stddef.h>
+
+#if JIT_SUPPORTED
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// Native code keeps the VM registers in callee saved machine registers,
+// rbx holds the stack base, r12 the stack pointer, r13 the base pointer
+// and r14 the jit, so C helpers can be called without saving them
+enum
+{
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3,
+    RSI = 6, RDI = 7, R12 = 12, R13 = 13, R14 = 14,
+};
+
+#define SP R12
+#define BP R13
+
+typedef struct JitBuffer
+{
+    unsigned char *data;
+    int size;
+    int capacity;
+} JitBuffer;
+
+typedef struct JitFixup
+{
+    int pos;
+    int target;
+    int is_call;
+} JitFixup;
+
+// Kinds of operation, in the order they appear in each operation set
+enum
+{
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+    OP_MORE_THAN, OP_LESS_THAN, OP_MORE_THAN_EQUALS,
+    OP_LESS_THAN_EQUALS, OP_EQUALS,
+};
+
+static void emit(JitBuffer *buffer, int byte)
+{
+    if (buffer->size >= buffer->capacity)
+    {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    buffer->data[buffer->size++] = byte;
+}
+
+static void emit_bytes(JitBuffer *buffer, const char *bytes, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        emit(buffer, (unsigned char)bytes[i]);
+}
+
+static void emit_int(JitBuffer *buffer, int i)
+{
+    int j;
+    for (j = 0; j < 4; j++)
+        emit(buffer, (i >> j*8) & 0xFF);
+}
+
+static void emit_pointer(JitBuffer *buffer, const void *pointer)
+{
+    unsigned long long value = (unsigned long long)pointer;
+    int j;
+    for (j = 0; j < 8; j++)
+        emit(buffer, (value >> j*8) & 0xFF);
+}
+
+// Emit an instruction with a memory operand of [rbx + index + disp].
+// Two byte opcodes are given as 0x0Fxx, and reg is either a register
+// or the opcode extension
+static void emit_mem(JitBuffer *buffer, int prefix, int wide, int op,
+    int reg, int index, int disp)
+{
+    int rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1);
+    if (prefix)
+        emit(buffer, prefix);
+    if (rex != 0x40)
+        emit(buffer, rex);
+    if (op > 0xFF)
+        emit(buffer, op >> 8);
+    emit(buffer, op & 0xFF);
+    emit(buffer, 0x84 | ((reg & 7) << 3));
+    emit(buffer, ((index & 7) << 3) | RBX);
+    emit_int(buffer, disp);
+}
+
+#define LOAD_4(reg, index, disp) emit_mem(buffer, 0, 0, 0x8B, reg, index, disp)
+#define STORE_4(reg, index, disp) emit_mem(buffer, 0, 0, 0x89, reg, index, disp)
+#define LOAD_8(reg, index, disp) emit_mem(buffer, 0, 1, 0x8B, reg, index, disp)
+#define STORE_8(reg, index, disp) emit_mem(buffer, 0, 1, 0x89, reg, index, disp)
+#define LOAD_1(reg, index, disp) emit_mem(buffer, 0, 0, 0x0FB6, reg, index, disp)
+#define STORE_1(reg, index, disp) emit_mem(buffer, 0, 0, 0x88, reg, index, disp)
+#define LEA(reg, index, disp) emit_mem(buffer, 0, 1, 0x8D, reg, index, disp)
+
+static void emit_add_sp(JitBuffer *buffer, int amount)
+{
+    // add r12d, imm32
+    if (amount == 0)
+        return;
+    emit_bytes(buffer, "\x41\x81\xC4", 3);
+    emit_int(buffer, amount);
+}
+
+static void emit_copy(JitBuffer *buffer, int to_index, int to_disp,
+    int from_index, int from_disp, int size)
+{
+    switch (size)
+    {
+        case 0:
+            break;
+        case 1:
+            LOAD_1(RAX, from_index, from_disp);
+            STORE_1(RAX, to_index, to_disp);
+            break;
+        case 4:
+            LOAD_4(RAX, from_index, from_disp);
+            STORE_4(RAX, to_index, to_disp);
+            break;
+        case 8:
+            LOAD_8(RAX, from_index, from_disp);
+            STORE_8(RAX, to_index, to_disp);
+            break;
+        default:
+            // rep movsb, which copies forwards so is fine for moving down
+            LEA(RSI, from_index, from_disp);
+            LEA(RDI, to_index, to_disp);
+            emit(buffer, 0xB9); emit_int(buffer, size);
+            emit_bytes(buffer, "\xF3\xA4", 2);
+            break;
+    }
+}
+
+static void emit_setcc(JitBuffer *buffer, int kind)
+{
+    static const int setcc[] = { 0, 0, 0, 0, 0x9F, 0x9C, 0x9D, 0x9E, 0x94 };
+    emit(buffer, 0x0F); emit(buffer, setcc[kind]); emit(buffer, 0xC0);
+}
+
+// Left is always in memory, the right either in memory or an immediate
+static void emit_int_operation(JitBuffer *buffer, int kind,
+    int left_index, int left_disp, int right_index, int right_disp,
+    int is_immediate, int immediate, int to_index, int to_disp)
+{
+    static const int mem_ops[] = { 0x03, 0x2B, 0x0FAF, 0, 0x3B, 0x3B, 0x3B, 0x3B, 0x3B };
+    LOAD_4(RAX, left_index, left_disp);
+
+    if (kind == OP_DIV)
+    {
+        emit(buffer, 0x99); // cdq
+        if (is_immediate)
+        {
+            emit(buffer, 0xB9); emit_int(buffer, immediate);
+            emit_bytes(buffer, "\xF7\xF9", 2); // idiv ecx
+        }
+        else
+            emit_mem(buffer, 0, 0, 0xF7, 7, right_index, right_disp);
+    }
+    else if (is_immediate)
+    {
+        switch (kind)
+        {
+            case OP_ADD: emit(buffer, 0x05); break;
+            case OP_SUB: emit(buffer, 0x2D); break;
+            case OP_MUL: emit_bytes(buffer, "\x69\xC0", 2); break;
+            default: emit(buffer, 0x3D); break;
+        }
+        emit_int(buffer, immediate);
+    }
+    else
+        emit_mem(buffer, 0, 0, mem_ops[kind], RAX, right_index, right_disp);
+
+    if (kind >= OP_MORE_THAN)
+    {
+        emit_setcc(buffer, kind);
+        STORE_1(RAX, to_index, to_disp);
+    }
+    else
+        STORE_4(RAX, to_index, to_disp);
+}
+
+static void emit_float_operation(JitBuffer *buffer, int kind,
+    int left_index, int left_disp, int right_index, int right_disp,
+    int to_index, int to_disp)
+{
+    static const int ops[] = { 0x0F58, 0x0F5C, 0x0F59, 0x0F5E };
+    switch (kind)
+    {
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            emit_mem(buffer, 0xF3, 0, 0x0F10, 0, left_index, left_disp);
+            emit_mem(buffer, 0xF3, 0, ops[kind], 0, right_index, right_disp);
+            emit_mem(buffer, 0xF3, 0, 0x0F11, 0, to_index, to_disp);
+            return;
+
+        // Unordered compares set the carry flag, so less than is done
+        // the other way around to give false for NaN like C does
+        case OP_MORE_THAN: case OP_MORE_THAN_EQUALS: case OP_EQUALS:
+            emit_mem(buffer, 0xF3, 0, 0x0F10, 0, left_index, left_disp);
+            emit_mem(buffer, 0, 0, 0x0F2F, 0, right_index, right_disp);
+            break;
+        case OP_LESS_THAN: case OP_LESS_THAN_EQUALS:
+            emit_mem(buffer, 0xF3, 0, 0x0F10, 0, right_index, right_disp);
+            emit_mem(buffer, 0, 0, 0x0F2F, 0, left_index, left_disp);
+            break;
+    }
+
+    switch (kind)
+    {
+        case OP_MORE_THAN: case OP_LESS_THAN:
+            emit_bytes(buffer, "\x0F\x97\xC0", 3); // seta al
+            break;
+        case OP_MORE_THAN_EQUALS: case OP_LESS_THAN_EQUALS:
+            emit_bytes(buffer, "\x0F\x93\xC0", 3); // setae al
+            break;
+        case OP_EQUALS:
+            emit_bytes(buffer, "\x0F\x94\xC0", 3); // sete al
+            emit_bytes(buffer, "\x0F\x9B\xC1", 3); // setnp cl
+            emit_bytes(buffer, "\x20\xC8", 2); // and al, cl
+            break;
+    }
+    STORE_1(RAX, to_index, to_disp);
+}
+
+static int call_external(VMJit *jit, int slot, char *stack, int sp, int bp)
+{
+    VMState state = { 0, sp, bp, 0, stack, 0, jit->stack };
+    jit->links[slot](&state);
+    return state.sp;
+}
+
+// One aligned 32 bit store, so the profiler never sees half of it
+_Static_assert(sizeof(sig_atomic_t) == 4, "frame is stored as 32 bits");
+
+static void emit_store_frame(JitBuffer *buffer)
+{
+    emit_bytes(buffer, "\x49\x8B\x86", 3); // mov rax, [r14 + frame]
+    emit_int(buffer, offsetof(VMJit, frame));
+    emit_bytes(buffer, "\x44\x89\x28", 3); // mov [rax], r13d
+}
+
+static void native_overflow(VMJit *jit)
+{
+    stack_overflow(jit->stack);
+}
+
+static void emit_prologue(JitBuffer *buffer)
+{
+    // Save the callee saved registers, five of them keeps the
+    // stack aligned for calls, then load the VM registers
+    emit_bytes(buffer, "\x53\x41\x54\x41\x55\x41\x56\x41\x57", 9);
+    emit_bytes(buffer, "\x48\x89\xFB", 3); // mov rbx, rdi
+    emit_bytes(buffer, "\x41\x89\xF4", 3); // mov r12d, esi
+    emit_bytes(buffer, "\x41\x89\xD5", 3); // mov r13d, edx
+    emit_bytes(buffer, "\x49\x89\xCE", 3); // mov r14, rcx
+
+    // Stop before nested calls run the host's stack out
+    emit_bytes(buffer, "\x49\x3B\xA6", 3); // cmp rsp, [r14 + host_floor]
+    emit_int(buffer, offsetof(VMJit, host_floor));
+    emit_bytes(buffer, "\x73\x0F", 2); // jae past the call
+    emit_bytes(buffer, "\x4C\x89\xF7", 3); // mov rdi, r14
+    emit_bytes(buffer, "\x48\xB8", 2); // mov rax, imm64
+    emit_pointer(buffer, (void*)native_overflow);
+    emit_bytes(buffer, "\xFF\xD0", 2); // call rax
+}
+
+static void emit_epilogue(JitBuffer *buffer)
+{
+    emit_bytes(buffer, "\x44\x89\xE0", 3); // mov eax, r12d
+    emit_bytes(buffer, "\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5B\xC3", 10);
+}
+
+// Half of the host's stack, assuming the smallest thread stack glibc 
+// gives if there's no limit to go by
+static long long host_budget()
+{
+    struct rlimit limit;
+    long long size = 2 * 1024 * 1024;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        size = limit.rlim_cur;
+    return size / 2;
+}
+
+static int is_supported(int op)
+{
+    if ((op >= BC_ADD_INT_INT && op <= BC_EQUALS_INT_INT) ||
+        (op >= BC_ADD_FLOAT_FLOAT && op <= BC_EQUALS_FLOAT_FLOAT) ||
+        (op >= BC_ADD_INT_INT_R && op <= BC_EQUALS_INT_INT_R) ||
+        (op >= BC_ADD_FLOAT_FLOAT_R && op <= BC_EQUALS_FLOAT_FLOAT_R) ||
+        (op >= BC_ADD_INT_INT_I && op <= BC_EQUALS_INT_INT_I))
+    {
+        return 1;
+    }
+
+    switch (op)
+    {
+        case BC_PUSH_1: case BC_PUSH_4: case BC_PUSH_X:
+        case BC_POP: case BC_ALLOC:
+        case BC_STORE_LOCAL_1: case BC_STORE_LOCAL_4:
+        case BC_STORE_LOCAL_8: case BC_STORE_LOCAL_X:
+        case BC_LOAD_LOCAL_1: case BC_LOAD_LOCAL_4:
+        case BC_LOAD_LOCAL_8: case BC_LOAD_LOCAL_X:
+        case BC_LOCAL_REF: case BC_COPY:
+        case BC_GET_ARRAY_INDEX: case BC_GET_ATTR: case BC_ASSIGN_REF_X:
+        case BC_CREATE_FRAME: case BC_CALL: case BC_CALL_EXTERNAL:
+        case BC_RETURN: case BC_JUMP: case BC_JUMP_IF_NOT:
+        case BC_MOVE_1: case BC_MOVE_4:
+        case BC_MOVE_CONST_1: case BC_MOVE_CONST_4:
+        case BC_JUMP_IF_NOT_R: case BC_NEW:
+        case BC_CAST_INT_INT: case BC_CAST_FLOAT_FLOAT:
+        case BC_CAST_INT_FLOAT: case BC_CAST_FLOAT_INT:
+            return 1;
+    }
+
+    return 0;
+}
+
+static void add_fixup(JitFixup **fixups, int *count, int pos,
+    int target, int is_call)
+{
+    *fixups = realloc(*fixups, (*count + 1) * sizeof(JitFixup));
+    (*fixups)[*count].pos = pos;
+    (*fixups)[*count].target = target;
+    (*fixups)[*count].is_call = is_call;
+    *count += 1;
+}
+
+// Refs past the stack's guard region go to a view of host memory, or 
+// stop the call if they're outside every view
+static void view_copy(VMJit *jit, int sp, int ref, int size, int store)
+{
+    char *stack = jit->stack->memory;
+    char *view = stack_view(jit->stack, ref, size);
+    if (view == NULL)
+        stack_bad_ref(jit->stack, ref);
+    else if (store)
+        memcpy(view, stack + sp - size, size);
+    else
+        memcpy(stack + sp, view, size);
+}
+
+// Allocates in place of the count on top of the stack
+static void heap_new(VMJit *jit, int sp, int size)
+{
+    char *stack = jit->stack->memory;
+    int count, ref;
+    memcpy(&count, stack + sp - 4, 4);
+    ref = stack_new(jit->stack, count, size);
+    if (ref == -1)
+        stack_out_of_heap(jit->stack);
+    memcpy(stack + sp - 4, &ref, 4);
+}
+
+static void patch_jump(JitBuffer *buffer, int pos)
+{
+    int rel = buffer->size - (pos + 4);
+    memcpy(buffer->data + pos, &rel, 4);
+}
+
+// Load or store size bytes through the ref in edx, only calling out for 
+// refs that aren't on the stack
+static void emit_ref_access(JitBuffer *buffer, const VMJit *jit, 
+    int size, int store)
+{
+    int to_stack, to_end;
+    emit_bytes(buffer, "\x81\xFA", 2); // cmp edx, imm32
+    emit_int(buffer, jit->stack->mapped_size);
+    emit_bytes(buffer, "\x0F\x82", 2); // jb
+    to_stack = buffer->size;
+    emit_int(buffer, 0);
+
+    emit_bytes(buffer, "\x4C\x89\xF7", 3); // mov rdi, r14
+    emit_bytes(buffer, "\x44\x89\xE6", 3); // mov esi, r12d
+    emit(buffer, 0xB9); emit_int(buffer, size); // mov ecx, size
+    emit_bytes(buffer, "\x41\xB8", 2); emit_int(buffer, store); // mov r8d, store
+    emit_bytes(buffer, "\x48\xB8", 2); // mov rax, imm64
+    emit_pointer(buffer, (void*)view_copy);
+    emit_bytes(buffer, "\xFF\xD0", 2); // call rax
+    emit(buffer, 0xE9); // jmp
+    to_end = buffer->size;
+    emit_int(buffer, 0);
+
+    patch_jump(buffer, to_stack);
+    if (store)
+        emit_copy(buffer, RDX, 0, SP, -size, size);
+    else
+        emit_copy(buffer, SP, 0, RDX, 0, size);
+    patch_jump(buffer, to_end);
+}
+
+static void emit_instr(JitBuffer *buffer, const VMJit *jit, int index,
+    const char *batch, JitFixup **fixups, int *fixup_count)
+{
+    const VMProgram *program = jit->program;
+    const VMInstr *in = &program->code[index];
+    int op = program_original_op(in->op);
+
+    if (op >= BC_ADD_INT_INT && op <= BC_EQUALS_INT_INT)
+    {
+        int kind = op - BC_ADD_INT_INT;
+        emit_int_operation(buffer, kind, SP, -8, SP, -4, 0, 0, SP, -8);
+        emit_add_sp(buffer, kind >= OP_MORE_THAN ? -7 : -4);
+        return;
+    }
+    if (op >= BC_ADD_FLOAT_FLOAT && op <= BC_EQUALS_FLOAT_FLOAT)
+    {
+        int kind = op - BC_ADD_FLOAT_FLOAT;
+        emit_float_operation(buffer, kind, SP, -8, SP, -4, SP, -8);
+        emit_add_sp(buffer, kind >= OP_MORE_THAN ? -7 : -4);
+        return;
+    }
+    if (op >= BC_ADD_INT_INT_R && op <= BC_EQUALS_INT_INT_R)
+    {
+        emit_int_operation(buffer, op - BC_ADD_INT_INT_R,
+            BP, in->b, BP, in->c, 0, 0, BP, in->a);
+        return;
+    }
+    if (op >= BC_ADD_FLOAT_FLOAT_R && op <= BC_EQUALS_FLOAT_FLOAT_R)
+    {
+        emit_float_operation(buffer, op - BC_ADD_FLOAT_FLOAT_R,
+            BP, in->b, BP, in->c, BP, in->a);
+        return;
+    }
+    if (op >= BC_ADD_INT_INT_I && op <= BC_EQUALS_INT_INT_I)
+    {
+        emit_int_operation(buffer, op - BC_ADD_INT_INT_I,
+            BP, in->b, 0, 0, 1, in->c, BP, in->a);
+        return;
+    }
+
+    switch (op)
+    {
+        case BC_PUSH_1:
+            emit_mem(buffer, 0, 0, 0xC6, 0, SP, 0); emit(buffer, in->a);
+            emit_add_sp(buffer, 1);
+            break;
+
+        case BC_PUSH_4:
+            emit_mem(buffer, 0, 0, 0xC7, 0, SP, 0); emit_int(buffer, in->a);
+            emit_add_sp(buffer, 4);
+            break;
+
+        case BC_PUSH_X:
+            // Copy from the program's data block, which outlives the code
+            LEA(RDI, SP, 0);
+            emit_bytes(buffer, "\x48\xBE", 2); // mov rsi, imm64
+            emit_pointer(buffer, program->data + in->b);
+            emit(buffer, 0xB9); emit_int(buffer, in->a);
+            emit_bytes(buffer, "\xF3\xA4", 2);
+            emit_add_sp(buffer, in->a);
+            break;
+
+        case BC_POP: emit_add_sp(buffer, -in->a); break;
+        case BC_ALLOC: emit_add_sp(buffer, in->a); break;
+
+        case BC_STORE_LOCAL_1:
+            emit_copy(buffer, BP, in->a, SP, -1, 1);
+            emit_add_sp(buffer, -1);
+            break;
+
+        case BC_STORE_LOCAL_4:
+            emit_copy(buffer, BP, in->a, SP, -4, 4);
+            emit_add_sp(buffer, -4);
+            break;
+
+        case BC_STORE_LOCAL_8:
+            emit_copy(buffer, BP, in->a, SP, -8, 8);
+            emit_add_sp(buffer, -8);
+            break;
+
+        case BC_STORE_LOCAL_X:
+            emit_copy(buffer, BP, in->b, SP, -in->a, in->a);
+            emit_add_sp(buffer, -in->a);
+            break;
+
+        case BC_LOAD_LOCAL_1:
+            emit_copy(buffer, SP, 0, BP, in->a, 1);
+            emit_add_sp(buffer, 1);
+            break;
+
+        case BC_LOAD_LOCAL_4:
+            emit_copy(buffer, SP, 0, BP, in->a, 4);
+            emit_add_sp(buffer, 4);
+            break;
+
+        case BC_LOAD_LOCAL_8:
+            emit_copy(buffer, SP, 0, BP, in->a, 8);
+            emit_add_sp(buffer, 8);
+            break;
+
+        case BC_LOAD_LOCAL_X:
+            emit_copy(buffer, SP, 0, BP, in->b, in->a);
+            emit_add_sp(buffer, in->a);
+            break;
+
+        case BC_LOCAL_REF:
+            emit_bytes(buffer, "\x41\x8D\x85", 3); // lea eax, [r13 + disp32]
+            emit_int(buffer, in->a);
+            STORE_4(RAX, SP, 0);
+            emit_add_sp(buffer, 4);
+            break;
+
+        case BC_COPY:
+            LOAD_4(RDX, SP, -4);
+            emit_add_sp(buffer, -4);
+            emit_ref_access(buffer, jit, in->a, 0);
+            emit_add_sp(buffer, in->a);
+            break;
+
+        case BC_GET_ARRAY_INDEX:
+            // Element address is sp + index * element size - array size
+            LOAD_4(RAX, SP, -4);
+            emit_bytes(buffer, "\x69\xC0", 2); emit_int(buffer, in->b);
+            emit_add_sp(buffer, -4);
+            emit_bytes(buffer, "\x44\x01\xE0", 3); // add eax, r12d
+            emit_copy(buffer, SP, -in->a, RAX, -in->a, in->b);
+            emit_add_sp(buffer, -(in->a - in->b));
+            break;
+
+        case BC_GET_ATTR:
+            emit_copy(buffer, SP, -in->c, SP, -in->c + in->a, in->b);
+            emit_add_sp(buffer, -(in->c - in->b));
+            break;
+
+        case BC_ASSIGN_REF_X:
+            LOAD_4(RDX, SP, -4);
+            emit_add_sp(buffer, -4);
+            emit_ref_access(buffer, jit, in->a, 1);
+            emit_add_sp(buffer, -in->a);
+            break;
+
+        case BC_CREATE_FRAME:
+            STORE_4(BP, SP, 0);
+            emit_add_sp(buffer, 4);
+            emit_bytes(buffer, "\x45\x89\xE5", 3); // mov r13d, r12d
+            emit_store_frame(buffer);
+            emit_add_sp(buffer, in->a);
+            break;
+
+        case BC_CALL:
+            // The callee discards the return index, but push it anyway
+            // so the frame looks the same as an interpreted one
+            emit_mem(buffer, 0, 0, 0xC7, 0, SP, 0); emit_int(buffer, index + 1);
+            emit_add_sp(buffer, 4);
+            emit_bytes(buffer, "\x48\x89\xDF", 3); // mov rdi, rbx
+            emit_bytes(buffer, "\x44\x89\xE6", 3); // mov esi, r12d
+            emit_bytes(buffer, "\x44\x89\xEA", 3); // mov edx, r13d
+            emit_bytes(buffer, "\x4C\x89\xF1", 3); // mov rcx, r14
+            if (batch[in->a])
+            {
+                emit(buffer, 0xE8);
+                add_fixup(fixups, fixup_count, buffer->size, in->a, 1);
+                emit_int(buffer, 0);
+            }
+            else
+            {
+                // Compiled earlier, so call through the natives table
+                emit_bytes(buffer, "\x49\x8B\x86", 3); // mov rax, [r14 + natives]
+                emit_int(buffer, offsetof(VMJit, natives));
+                emit_bytes(buffer, "\x48\x8B\x80", 3); // mov rax, [rax + disp32]
+                emit_int(buffer, in->a * (int)sizeof(VMNative));
+                emit_bytes(buffer, "\xFF\xD0", 2); // call rax
+            }
+            emit_bytes(buffer, "\x41\x89\xC4", 3); // mov r12d, eax
+            break;
+
+        case BC_CALL_EXTERNAL:
+            emit_bytes(buffer, "\x4C\x89\xF7", 3); // mov rdi, r14
+            emit(buffer, 0xBE); emit_int(buffer, in->a); // mov esi, slot
+            emit_bytes(buffer, "\x48\x89\xDA", 3); // mov rdx, rbx
+            emit_bytes(buffer, "\x44\x89\xE1", 3); // mov ecx, r12d
+            emit_bytes(buffer, "\x45\x89\xE8", 3); // mov r8d, r13d
+            emit_bytes(buffer, "\x48\xB8", 2); // mov rax, imm64
+            emit_pointer(buffer, (void*)call_external);
+            emit_bytes(buffer, "\xFF\xD0", 2); // call rax
+            emit_bytes(buffer, "\x41\x89\xC4", 3); // mov r12d, eax
+            break;
+
+        case BC_NEW:
+            emit_bytes(buffer, "\x4C\x89\xF7", 3); // mov rdi, r14
+            emit_bytes(buffer, "\x44\x89\xE6", 3); // mov esi, r12d
+            emit(buffer, 0xBA); emit_int(buffer, in->a); // mov edx, size
+            emit_bytes(buffer, "\x48\xB8", 2); // mov rax, imm64
+            emit_pointer(buffer, (void*)heap_new);
+            emit_bytes(buffer, "\xFF\xD0", 2); // call rax
+            break;
+
+        case BC_RETURN:
+            emit_copy(buffer, BP, -8 - in->b - in->a, SP, -in->a, in->a);
+            emit_bytes(buffer, "\x45\x89\xEC", 3); // mov r12d, r13d
+            LOAD_4(BP, SP, -4);
+            emit_store_frame(buffer);
+            emit_add_sp(buffer, -8 - in->b);
+            emit_epilogue(buffer);
+            break;
+
+        case BC_JUMP:
+            emit(buffer, 0xE9);
+            add_fixup(fixups, fixup_count, buffer->size, in->a, 0);
+            emit_int(buffer, 0);
+            break;
+
+        case BC_JUMP_IF_NOT:
+            LOAD_1(RAX, SP, -1);
+            emit_add_sp(buffer, -1);
+            emit_bytes(buffer, "\x84\xC0\x0F\x84", 4); // test al, al; jz
+            add_fixup(fixups, fixup_count, buffer->size, in->a, 0);
+            emit_int(buffer, 0);
+            break;
+
+        case BC_MOVE_1: emit_copy(buffer, BP, in->a, BP, in->b, 1); break;
+        case BC_MOVE_4: emit_copy(buffer, BP, in->a, BP, in->b, 4); break;
+
+        case BC_MOVE_CONST_1:
+            emit_mem(buffer, 0, 0, 0xC6, 0, BP, in->a); emit(buffer, in->b);
+            break;
+
+        case BC_MOVE_CONST_4:
+            emit_mem(buffer, 0, 0, 0xC7, 0, BP, in->a); emit_int(buffer, in->b);
+            break;
+
+        case BC_JUMP_IF_NOT_R:
+            emit_mem(buffer, 0, 0, 0x80, 7, BP, in->b); emit(buffer, 0);
+            emit_bytes(buffer, "\x0F\x84", 2); // je
+            add_fixup(fixups, fixup_count, buffer->size, in->a, 0);
+            emit_int(buffer, 0);
+            break;
+
+        case BC_CAST_INT_FLOAT:
+            emit_mem(buffer, 0xF3, 0, 0x0F2A, 0, SP, -4); // cvtsi2ss
+            emit_mem(buffer, 0xF3, 0, 0x0F11, 0, SP, -4);
+            break;
+
+        case BC_CAST_FLOAT_INT:
+            emit_mem(buffer, 0xF3, 0, 0x0F2C, RAX, SP, -4); // cvttss2si
+            STORE_4(RAX, SP, -4);
+            break;
+
+        // Casts to the same type do nothing
+        default:
+            break;
+    }
+}
+
+void jit_init(VMJit *jit, const VMProgram *program, 
+    VMFunc *links, const char *async, VMStack *stack)
+{
+    int size = program->size;
+    int i, changed;
+
+    jit->natives = calloc(size, sizeof(VMNative));
+    jit->loops = calloc(size, sizeof(VMNative));
+    jit->program = program;
+    jit->links = links;
+    jit->frame = &stack->frame;
+    jit->stack = stack;
+    jit->host_floor = NULL;
+    jit->host_budget = host_budget();
+    jit->function_of = malloc(size * sizeof(int));
+    jit->compilable = calloc(size, 1);
+    jit->chunks = NULL;
+    jit->chunk_sizes = NULL;
+    jit->chunk_count = 0;
+
+    // Each function starts by creating its frame and runs up to the next
+    int start = -1;
+    for (i = 0; i < size; i++)
+    {
+        if (program_original_op(program->code[i].op) == BC_CREATE_FRAME)
+        {
+            start = i;
+            jit->compilable[i] = 1;
+        }
+        jit->function_of[i] = start;
+    }
+
+    // Leave any function with an opcode there's no template for, that 
+    // jumps outside of itself or that could be suspended to the 
+    // interpreter
+    for (i = 0; i < size; i++)
+    {
+        const VMInstr *instr = &program->code[i];
+        int op = program_original_op(instr->op);
+        if (jit->function_of[i] == -1)
+            continue;
+
+        int jumps_out = (op == BC_JUMP || op == BC_JUMP_IF_NOT ||
+            op == BC_JUMP_IF_NOT_R) && 
+            jit->function_of[instr->a] != jit->function_of[i];
+        // Templates don't check the stack, so frames that need it are 
+        // left to the interpreter too
+        int checks_frame = op == BC_CREATE_FRAME && instr->c;
+        int suspends = op == BC_CALL_EXTERNAL && async[instr->a];
+        if (!is_supported(op) || jumps_out || checks_frame || suspends)
+            jit->compilable[jit->function_of[i]] = 0;
+    }
+
+    // Native code can only call other native code, so keep dropping
+    // callers of interpreted functions until nothing changes
+    do
+    {
+        changed = 0;
+        for (i = 0; i < size; i++)
+        {
+            const VMInstr *instr = &program->code[i];
+            int function = jit->function_of[i];
+            if (program_original_op(instr->op) != BC_CALL || 
+                function == -1 || !jit->compilable[function])
+            {
+                continue;
+            }
+
+            if (jit->function_of[instr->a] != instr->a || 
+                !jit->compilable[instr->a])
+            {
+                jit->compilable[function] = 0;
+                changed = 1;
+            }
+        }
+    } while (changed);
+}
+
+int jit_compile(VMJit *jit, int function)
+{
+    const VMProgram *program = jit->program;
+    int size = program->size;
+    int i;
+
+    if (jit->natives[function])
+        return 0;
+    if (!jit->compilable[function])
+        return -1;
+
+    // Gather up the function and every callee without native code yet,
+    // these can call each other directly
+    char *batch = calloc(size, 1);
+    int *pending = malloc(size * sizeof(int));
+    int pending_count = 0;
+    batch[function] = 1;
+    pending[pending_count++] = function;
+    while (pending_count > 0)
+    {
+        int start = pending[--pending_count];
+        for (i = start; i < size && jit->function_of[i] == start; i++)
+        {
+            const VMInstr *instr = &program->code[i];
+            if (program_original_op(instr->op) != BC_CALL || 
+                batch[instr->a] || jit->natives[instr->a])
+            {
+                continue;
+            }
+
+            batch[instr->a] = 1;
+            pending[pending_count++] = instr->a;
+        }
+    }
+
+    int *offsets = malloc(size * sizeof(int));
+    int *entries = malloc(size * sizeof(int));
+    int *loop_entries = malloc(size * sizeof(int));
+    JitFixup *fixups = NULL;
+    int fixup_count = 0;
+    JitBuffer buffer = { NULL, 0, 0 };
+    for (i = 0; i < size; i++)
+        loop_entries[i] = -1;
+
+    for (i = 0; i < size; i++)
+    {
+        if (jit->function_of[i] == -1 || !batch[jit->function_of[i]])
+            continue;
+
+        if (jit->function_of[i] == i)
+        {
+            entries[i] = buffer.size;
+            emit_prologue(&buffer);
+        }
+
+        offsets[i] = buffer.size;
+        emit_instr(&buffer, jit, i, batch, &fixups, &fixup_count);
+    }
+
+    // Loop entries set up the registers the same way, then jump
+    // into the function at the top of the loop
+    for (i = 0; i < size; i++)
+    {
+        const VMInstr *instr = &program->code[i];
+        if (jit->function_of[i] == -1 || !batch[jit->function_of[i]] ||
+            program_original_op(instr->op) != BC_JUMP || instr->a > i ||
+            loop_entries[instr->a] != -1)
+        {
+            continue;
+        }
+
+        loop_entries[instr->a] = buffer.size;
+        emit_prologue(&buffer);
+        emit(&buffer, 0xE9);
+        add_fixup(&fixups, &fixup_count, buffer.size, instr->a, 0);
+        emit_int(&buffer, 0);
+    }
+
+    for (i = 0; i < fixup_count; i++)
+    {
+        JitFixup *fixup = &fixups[i];
+        int target = fixup->is_call ?
+            entries[fixup->target] : offsets[fixup->target];
+        int rel = target - (fixup->pos + 4);
+        memcpy(buffer.data + fixup->pos, &rel, 4);
+    }
+
+    // Write the code then make it executable, but never both at once
+    int result = 0;
+    char *memory = mmap(NULL, buffer.size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        printf("Error: Could not allocate memory for the JIT\n");
+        result = -1;
+    }
+    else
+    {
+        memcpy(memory, buffer.data, buffer.size);
+        mprotect(memory, buffer.size, PROT_READ | PROT_EXEC);
+
+        int count = jit->chunk_count + 1;
+        jit->chunks = realloc(jit->chunks, count * sizeof(char*));
+        jit->chunk_sizes = realloc(jit->chunk_sizes, count * sizeof(int));
+        jit->chunks[jit->chunk_count] = memory;
+        jit->chunk_sizes[jit->chunk_count] = buffer.size;
+        jit->chunk_count = count;
+
+        for (i = 0; i < size; i++)
+        {
+            if (loop_entries[i] != -1)
+                jit->loops[i] = (VMNative)(memory + loop_entries[i]);
+            if (!batch[i])
+                continue;
+
+            jit->natives[i] = (VMNative)(memory + entries[i]);
+#if DEBUG_VM
+            printf("JIT compiled function at %i\n", i);
+#endif
+        }
+    }
+
+    free(batch);
+    free(pending);
+    free(offsets);
+    free(entries);
+    free(loop_entries);
+    free(fixups);
+    free(buffer.data);
+    return result;
+}
+
+void jit_compile_all(VMJit *jit)
+{
+    int i;
+    for (i = 0; i < jit->program->size; i++)
+    {
+        if (jit->function_of[i] == i && jit->compilable[i])
+            jit_compile(jit, i);
+    }
+}
+
+void jit_free(VMJit *jit)
+{
+    int i;
+    for (i = 0; i < jit->chunk_count; i++)
+        munmap(jit->chunks[i], jit->chunk_sizes[i]);
+    free(jit->chunks);
+    free(jit->chunk_sizes);
+    free(jit->natives);
+    free(jit->loops);
+    free(jit->function_of);
+    free(jit->compilable);
+    jit->chunks = NULL;
+    jit->chunk_sizes = NULL;
+    jit->chunk_count = 0;
+    jit->natives = NULL;
+    jit->loops = NULL;
+    jit->function_of = NULL;
+    jit->compilable = NULL;
+}
+
+#endif // JIT_SUPPORTED
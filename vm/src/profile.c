@@ -0,0 +1,234 @@
+#include "profile.h"
+#include "bytecode.h"
+#include "flags.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#if PROFILE_SUPPORTED
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+static _Thread_local VMProfile *current_profile = NULL;
+static atomic_int timer_in_use = 0;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+
+static int read_int(const VMStack *stack, int at)
+{
+    int value;
+    memcpy(&value, stack->memory + at, 4);
+    return value;
+}
+
+// A frame was made by the call just before the instruction it returns
+// to, or gives -1 if that's not a call
+static int call_site(const VMProfile *profile, int frame)
+{
+    const VMProgram *program = profile->program;
+    int return_index = read_int(profile->stack, frame - 8);
+    if (return_index < 1 || return_index > program->size ||
+        program->code[return_index - 1].op != BC_CALL)
+    {
+        return -1;
+    }
+
+    return return_index - 1;
+}
+
+static int is_frame(const VMStack *stack, int frame)
+{
+    return frame >= 8 && frame <= stack->size;
+}
+
+// The entry function's frame saved a zero base pointer, every other
+// frame's function is the target of the call that made it
+static int frame_function(const VMProfile *profile, int frame)
+{
+    if (is_frame(profile->stack, frame) &&
+        read_int(profile->stack, frame - 4) > 0)
+    {
+        int site = call_site(profile, frame);
+        if (site != -1)
+            return profile->program->code[site].a;
+    }
+
+    return profile->entry;
+}
+
+// Runs on whichever thread the timer caught, so anything this thread
+// isn't running is ignored. The stack can be caught part way through
+// a call or return, so everything read from it is checked first
+static void take_sample(int signal)
+{
+    VMProfile *profile = current_profile;
+    const VMProgram *program;
+    int chain[VM_PROFILE_DEPTH];
+    int depth = 0;
+
+    if (profile == NULL || !profile->running ||
+        (program = profile->program) == NULL)
+    {
+        return;
+    }
+
+    // Native code doesn't say where it is, so the innermost frame is
+    // put down to the start of its function
+    const VMStack *stack = profile->stack;
+    const VMInstr *ip = profile->ip;
+    int frame = stack->frame;
+    if (ip != NULL)
+        chain[depth++] = program->offsets[ip - program->code];
+    else
+        chain[depth++] = program->offsets[frame_function(profile, frame)];
+
+    while (depth < VM_PROFILE_DEPTH && is_frame(stack, frame))
+    {
+        int below = read_int(stack, frame - 4);
+        int site = call_site(profile, frame);
+        if (below <= 0 || below >= frame || site == -1)
+            break;
+
+        chain[depth++] = program->offsets[site];
+        frame = below;
+    }
+
+    if (profile->used + depth + 1 > profile->buffer_size)
+    {
+        profile->dropped += 1;
+        return;
+    }
+
+    int *sample = profile->buffer + profile->used;
+    sample[0] = depth;
+    memcpy(sample + 1, chain, depth * sizeof(int));
+    profile->used += depth + 1;
+}
+
+// The handler stays installed once the first profile starts, as a
+// signal can still be pending after the timer is stopped
+static void install_handler()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = take_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+}
+
+static void set_timer(int interval)
+{
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+int profile_start(VMProfile *profile, int frequency)
+{
+    int expected = 0;
+    if (frequency <= 0 || frequency > 1000000)
+    {
+        printf("Error: Invalid profile frequency %i\n", frequency);
+        return -1;
+    }
+
+    if (!atomic_compare_exchange_strong(&timer_in_use, &expected, 1))
+    {
+        printf("Error: Another context is already being profiled\n");
+        return -1;
+    }
+
+    if (profile->buffer == NULL)
+        profile->buffer = malloc(VM_PROFILE_BUFFER * sizeof(int));
+    profile->buffer_size = VM_PROFILE_BUFFER;
+    profile->used = 0;
+    profile->dropped = 0;
+    profile->frequency = frequency;
+    profile->running = 1;
+
+    pthread_once(&handler_once, install_handler);
+    set_timer(1000000 / frequency);
+    return 0;
+}
+
+void profile_stop(VMProfile *profile)
+{
+    VMProfileStats *stats = &profile->stats;
+    int at, count = 0;
+
+    if (!profile->running)
+        return;
+
+    set_timer(0);
+    profile->running = 0;
+    atomic_store(&timer_in_use, 0);
+
+    for (at = 0; at < profile->used; at += profile->buffer[at] + 1)
+        count += 1;
+
+    free(stats->samples);
+    stats->samples = malloc(count * sizeof(VMSample));
+    stats->sample_count = count;
+    stats->dropped = profile->dropped;
+    stats->frequency = profile->frequency;
+
+    count = 0;
+    for (at = 0; at < profile->used; at += profile->buffer[at] + 1)
+    {
+        VMSample *sample = &stats->samples[count++];
+        sample->depth = profile->buffer[at];
+        sample->offsets = profile->buffer + at + 1;
+    }
+}
+
+void profile_enter(VMProfile *profile, const VMProgram *program,
+    const VMStack *stack, int entry)
+{
+    profile->stack = stack;
+    profile->entry = entry;
+    profile->ip = NULL;
+    profile->program = program;
+    current_profile = profile;
+}
+
+void profile_leave(VMProfile *profile)
+{
+    profile->program = NULL;
+    current_profile = NULL;
+}
+
+#else
+
+int profile_start(VMProfile *profile, int frequency)
+{
+    printf("Error: Profiling isn't supported on this platform\n");
+    return -1;
+}
+
+void profile_stop(VMProfile *profile)
+{
+}
+
+void profile_enter(VMProfile *profile, const VMProgram *program,
+    const VMStack *stack, int entry)
+{
+}
+
+void profile_leave(VMProfile *profile)
+{
+}
+
+#endif // PROFILE_SUPPORTED
+
+void profile_free(VMProfile *profile)
+{
+    profile_stop(profile);
+    free(profile->buffer);
+    free(profile->stats.samples);
+    profile->buffer = NULL;
+    profile->stats.samples = NULL;
+}
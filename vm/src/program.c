@@ -0,0 +1,349 @@
+#include "program.h"
+#include "bytecode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+
+#define INT_AT(at) *(const int*)(code + (at))
+
+typedef struct FusedPattern
+{
+    int op;
+    int length;
+    int codes[5];
+} FusedPattern;
+
+#define GENERATE_PATTERN(ENUM, ...) { ENUM, FUSED_LENGTH(__VA_ARGS__), { __VA_ARGS__ } },
+
+static const FusedPattern fused_patterns[] = 
+{
+    FOR_EACH_FUSED(GENERATE_PATTERN)
+};
+
+#define PATTERN_COUNT (int)(sizeof(fused_patterns) / sizeof(FusedPattern))
+
+// Sized loads and stores with a typed form are turned into it, which 
+// takes the offset in a, so the copy size is known at compile time
+static void narrow_local(VMInstr *instr)
+{
+    int is_store = instr->op == BC_STORE_LOCAL_X;
+    switch (instr->a)
+    {
+        case 1: instr->op = is_store ? BC_STORE_LOCAL_1 : BC_LOAD_LOCAL_1; break;
+        case 4: instr->op = is_store ? BC_STORE_LOCAL_4 : BC_LOAD_LOCAL_4; break;
+        case 8: instr->op = is_store ? BC_STORE_LOCAL_8 : BC_LOAD_LOCAL_8; break;
+        default: return;
+    }
+    instr->a = instr->b;
+    instr->b = 0;
+}
+
+static int decode_instr(VMInstr *instr, const char *code, int pc,
+    char *data, int *data_size)
+{
+    int op = (unsigned char)code[pc++];
+    int size = bytecode_size[op];
+    int i;
+
+    instr->op = op;
+    instr->a = 0;
+    instr->b = 0;
+    instr->c = 0;
+    switch (op)
+    {
+        // Single signed byte operands
+        case BC_PUSH_1:
+        case BC_POP:
+        case BC_ALLOC:
+        case BC_STORE_LOCAL_1:
+        case BC_STORE_LOCAL_4:
+        case BC_STORE_LOCAL_8:
+        case BC_LOAD_LOCAL_1:
+        case BC_LOAD_LOCAL_4:
+        case BC_LOAD_LOCAL_8:
+        case BC_LOCAL_REF:
+        case BC_COPY:
+            instr->a = code[pc];
+            break;
+
+        // Copy the inline data out into the data block
+        case BC_PUSH_X:
+            size = (unsigned char)code[pc++];
+            instr->a = size;
+            instr->b = *data_size;
+            memcpy(data + *data_size, code + pc, size);
+            *data_size += size;
+            break;
+
+        // Size followed by a local offset
+        case BC_STORE_LOCAL_X:
+        case BC_LOAD_LOCAL_X:
+            instr->a = INT_AT(pc);
+            instr->b = code[pc + 4];
+            narrow_local(instr);
+            break;
+
+        // Wide forms decode to the same records as the byte offset ones, 
+        // so only those need handling past here
+        case BC_STORE_LOCAL_W:
+        case BC_LOAD_LOCAL_W:
+            instr->op = op == BC_STORE_LOCAL_W ? BC_STORE_LOCAL_X : BC_LOAD_LOCAL_X;
+            instr->a = INT_AT(pc);
+            instr->b = INT_AT(pc + 4);
+            narrow_local(instr);
+            break;
+
+        case BC_LOCAL_REF_W:
+            instr->op = BC_LOCAL_REF;
+            instr->a = INT_AT(pc);
+            break;
+
+        // Constants are already in the data block, so push them from there
+        case BC_PUSH_CONST:
+            instr->op = BC_PUSH_X;
+            instr->a = INT_AT(pc);
+            instr->b = INT_AT(pc + 4);
+            break;
+
+        case BC_RETURN:
+            instr->a = code[pc];
+            instr->b = code[pc + 1];
+            break;
+
+        // Wide sizes decode to the same records as the byte ones
+        case BC_POP_W: instr->op = BC_POP; instr->a = INT_AT(pc); break;
+        case BC_ALLOC_W: instr->op = BC_ALLOC; instr->a = INT_AT(pc); break;
+        case BC_COPY_W: instr->op = BC_COPY; instr->a = INT_AT(pc); break;
+
+        case BC_RETURN_W:
+            instr->op = BC_RETURN;
+            instr->a = INT_AT(pc);
+            instr->b = INT_AT(pc + 4);
+            break;
+
+        // Everything else is made up of int operands
+        default:
+            for (i = 0; i < size / 4; i++)
+                (&instr->a)[i] = INT_AT(pc + i * 4);
+            break;
+    }
+
+    return pc + size;
+}
+
+// How many bytes of operands follow the op at pc, which for PUSH_X is 
+// its length byte and the data after it. Gives -1 if they'd run past 
+// the end of the code
+static int operand_size(const char *code, int pc, int size)
+{
+    int op = (unsigned char)code[pc];
+    int operands = bytecode_size[op];
+    if (op == BC_PUSH_X)
+    {
+        if (pc + 1 >= size)
+            return -1;
+        operands = 1 + (unsigned char)code[pc + 1];
+    }
+
+    if (operands > size - pc - 1)
+        return -1;
+    return operands;
+}
+
+static int is_jump(int op)
+{
+    return op == BC_JUMP || op == BC_JUMP_IF_NOT || 
+        op == BC_JUMP_IF_NOT_R || op == BC_CALL;
+}
+
+int program_decode(VMProgram *program, const char *code, int size,
+    const char *constants, int constant_size)
+{
+    int pc = 0, count = 0, data_size = constant_size;
+    int i;
+
+    // Every instruction is at least one byte, so this is enough room. 
+    // The constant pool goes first in the data block, so constants keep 
+    // their offsets, and inline data from PUSH_X follows
+    program->code = malloc(size * sizeof(VMInstr));
+    program->offsets = malloc(size * sizeof(int));
+    program->data = malloc(constant_size + size);
+    program->size = 0;
+    memcpy(program->data, constants, constant_size);
+
+    while (pc < size)
+    {
+        int op = (unsigned char)code[pc];
+        if (op >= BC_SIZE)
+        {
+            printf("Error: Unkown bytecode %i at %i\n", op, pc);
+            program_free(program);
+            return -1;
+        }
+
+        // Operands are checked before they're read, so a truncated 
+        // instruction can't read or copy past the end of the code
+        if (operand_size(code, pc, size) == -1)
+        {
+            printf("Error: Invalid code section, %s at %i runs past the end\n",
+                bytecode_names[op], pc);
+            program_free(program);
+            return -1;
+        }
+
+        program->offsets[count] = pc;
+        pc = decode_instr(&program->code[count], code, pc,
+            program->data, &data_size);
+        count += 1;
+
+        const VMInstr *instr = &program->code[count - 1];
+        if (op == BC_PUSH_CONST && (instr->a < 0 || instr->b < 0 || 
+            instr->a > constant_size - instr->b))
+        {
+            printf("Error: Constant out of range at %i\n", 
+                program->offsets[count - 1]);
+            program_free(program);
+            return -1;
+        }
+    }
+    program->size = count;
+
+    // Resolve all jumps to instruction indices
+    for (i = 0; i < count; i++)
+    {
+        VMInstr *instr = &program->code[i];
+        if (!is_jump(instr->op))
+            continue;
+
+        int target = program_find(program, instr->a);
+        if (target == -1)
+        {
+            printf("Error: Invalid jump from %i to %i\n",
+                program->offsets[i], instr->a);
+            program_free(program);
+            return -1;
+        }
+        instr->a = target;
+    }
+
+    return 0;
+}
+
+static int pattern_matches(const VMProgram *program, const char *is_target, 
+    int at, const FusedPattern *pattern)
+{
+    int i;
+    if (at + pattern->length > program->size)
+        return 0;
+
+    // Nothing may jump into the middle of a fused sequence
+    for (i = 0; i < pattern->length; i++)
+    {
+        if (program->code[at + i].op != pattern->codes[i])
+            return 0;
+        if (i > 0 && is_target[at + i])
+            return 0;
+    }
+
+    return 1;
+}
+
+void program_fuse(VMProgram *program, int start, int end)
+{
+    int size = program->size;
+    char *is_target = calloc(size + 1, 1);
+    int *cost = malloc((size + 1) * sizeof(int));
+    int *choice = malloc((size + 1) * sizeof(int));
+    int i, j;
+
+    // Find everywhere execution can start from other than the 
+    // previous instruction, including where calls return to
+    for (i = 0; i < size; i++)
+    {
+        VMInstr *instr = &program->code[i];
+        if (is_jump(instr->op))
+            is_target[instr->a] = 1;
+        if (instr->op == BC_CALL)
+            is_target[i + 1] = 1;
+        if (instr->op == BC_CREATE_FRAME)
+            is_target[i] = 1;
+    }
+
+    // Work backwards to find the fewest dispatches needed to run 
+    // from each instruction to the end
+    cost[end] = 0;
+    for (i = end - 1; i >= start; i--)
+    {
+        cost[i] = cost[i + 1] + 1;
+        choice[i] = -1;
+        for (j = 0; j < PATTERN_COUNT; j++)
+        {
+            const FusedPattern *pattern = &fused_patterns[j];
+            if (i + pattern->length <= end &&
+                pattern_matches(program, is_target, i, pattern) && 
+                cost[i + pattern->length] + 1 < cost[i])
+            {
+                cost[i] = cost[i + pattern->length] + 1;
+                choice[i] = j;
+            }
+        }
+    }
+
+    // The fused instruction reads the operands of the ones it covers, 
+    // so they're left in place and skipped over. This also means code 
+    // can be fused while it's running, as resuming part way through a 
+    // sequence still finds the original codes
+    i = start;
+    while (i < end)
+    {
+        if (choice[i] == -1)
+        {
+            i += 1;
+            continue;
+        }
+
+        const FusedPattern *pattern = &fused_patterns[choice[i]];
+        program->code[i].op = pattern->op;
+        i += pattern->length;
+    }
+
+    free(is_target);
+    free(cost);
+    free(choice);
+}
+
+int program_original_op(int op)
+{
+    if (op > BC_SIZE && op < BC_COUNT)
+        return fused_patterns[op - BC_SIZE - 1].codes[0];
+    return op;
+}
+
+int program_find(const VMProgram *program, int offset)
+{
+    int low = 0, high = program->size - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (program->offsets[mid] == offset)
+            return mid;
+
+        if (program->offsets[mid] < offset)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+
+    return -1;
+}
+
+void program_free(VMProgram *program)
+{
+    free(program->code);
+    free(program->offsets);
+    free(program->data);
+    program->code = NULL;
+    program->offsets = NULL;
+    program->data = NULL;
+    program->size = 0;
+}
@@ -0,0 +1,540 @@
+#include "scheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#if SCHEDULER_SUPPORTED
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef enum TaskState
+{
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_SUSPENDED,
+
+    // Woken while still running, so it's queued again once it suspends
+    TASK_WOKEN,
+    TASK_DONE,
+} TaskState;
+
+// A context and the script it last loaded, known by the code it was
+// loaded from so a later task can tell it's the same without reading it
+typedef struct VMFiber
+{
+    VMContext *context;
+    VMScript *script;
+    const char *code;
+    int size;
+
+    struct VMFiber *next_idle;
+    struct VMFiber *next;
+} VMFiber;
+
+struct VMTask
+{
+    VMScheduler *scheduler;
+    const char *code;
+    int size;
+    int start;
+    char *return_value;
+
+    atomic_int state;
+    VMFiber *fiber;
+    int result;
+};
+
+// Owners push and pop at the back, thieves take from the front
+typedef struct TaskQueue
+{
+    pthread_mutex_t lock;
+    VMTask **tasks;
+    int head;
+    int count;
+    int capacity;
+} TaskQueue;
+
+typedef struct Worker
+{
+    VMScheduler *scheduler;
+    pthread_t thread;
+    int index;
+    unsigned int seed;
+    TaskQueue queue;
+
+    // Only touched by the worker's own thread
+    VMFiber *idle;
+} Worker;
+
+struct VMScheduler
+{
+    Worker *workers;
+    int worker_count;
+    int stack_size;
+    VMSetup setup;
+
+    // Tasks in any queue, and workers waiting for one. A task is counted
+    // before it's pushed, so a worker may look once more for nothing
+    // but never sleeps while one is queued
+    atomic_int queued;
+    atomic_int sleeping;
+    atomic_uint next_worker;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int stopping;
+
+    pthread_mutex_t done_lock;
+    pthread_cond_t done;
+    int awaiting;
+
+    // Every fiber made, for freeing at the end
+    pthread_mutex_t fiber_lock;
+    VMFiber *fibers;
+};
+
+static _Thread_local VMTask *current_task = NULL;
+
+static void queue_init(TaskQueue *queue)
+{
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->tasks = NULL;
+    queue->head = 0;
+    queue->count = 0;
+    queue->capacity = 0;
+}
+
+static void queue_free(TaskQueue *queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->tasks);
+}
+
+// The oldest end is taken last by the owner and first by thieves
+static void queue_push(TaskQueue *queue, VMTask *task, int oldest)
+{
+    int i;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity)
+    {
+        int capacity = queue->capacity ? queue->capacity * 2 : 64;
+        VMTask **tasks = malloc(capacity * sizeof(VMTask*));
+        for (i = 0; i < queue->count; i++)
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+
+    if (oldest)
+    {
+        queue->head = (queue->head + queue->capacity - 1) % queue->capacity;
+        queue->tasks[queue->head] = task;
+    }
+    else
+    {
+        queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    }
+    queue->count += 1;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static VMTask *queue_pop(TaskQueue *queue, int newest)
+{
+    VMTask *task = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0)
+    {
+        if (newest)
+        {
+            task = queue->tasks[(queue->head + queue->count - 1) %
+                queue->capacity];
+        }
+        else
+        {
+            task = queue->tasks[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        }
+        queue->count -= 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+static void enqueue(VMScheduler *scheduler, Worker *worker, VMTask *task,
+    int oldest)
+{
+    atomic_fetch_add(&scheduler->queued, 1);
+    queue_push(&worker->queue, task, oldest);
+
+    if (atomic_load(&scheduler->sleeping) > 0)
+    {
+        pthread_mutex_lock(&scheduler->lock);
+        pthread_cond_signal(&scheduler->work);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+static Worker *next_worker(VMScheduler *scheduler)
+{
+    unsigned int next = atomic_fetch_add(&scheduler->next_worker, 1);
+    return &scheduler->workers[next % scheduler->worker_count];
+}
+
+// Look in the worker's own queue first, then steal from the others
+// starting from a random one, so thieves don't all pick the same one
+static VMTask *find_task(Worker *worker)
+{
+    VMScheduler *scheduler = worker->scheduler;
+    int count = scheduler->worker_count;
+    int i;
+
+    VMTask *task = queue_pop(&worker->queue, 1);
+    if (task == NULL && count > 1)
+    {
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 17;
+        worker->seed ^= worker->seed << 5;
+        int first = worker->seed % count;
+        for (i = 0; i < count && task == NULL; i++)
+        {
+            Worker *victim = &scheduler->workers[(first + i) % count];
+            if (victim != worker)
+                task = queue_pop(&victim->queue, 0);
+        }
+    }
+
+    if (task != NULL)
+        atomic_fetch_sub(&scheduler->queued, 1);
+    return task;
+}
+
+static VMFiber *take_fiber(Worker *worker)
+{
+    VMScheduler *scheduler = worker->scheduler;
+    VMFiber *fiber = worker->idle;
+    if (fiber != NULL)
+    {
+        worker->idle = fiber->next_idle;
+        return fiber;
+    }
+
+    VMContext *context = vm_create(scheduler->stack_size);
+    if (context == NULL)
+        return NULL;
+    if (scheduler->setup != NULL)
+        scheduler->setup(context);
+
+    fiber = calloc(1, sizeof(VMFiber));
+    fiber->context = context;
+    pthread_mutex_lock(&scheduler->fiber_lock);
+    fiber->next = scheduler->fibers;
+    scheduler->fibers = fiber;
+    pthread_mutex_unlock(&scheduler->fiber_lock);
+    return fiber;
+}
+
+static void unload_fiber(VMFiber *fiber)
+{
+    if (fiber->script != NULL)
+        vm_unload(fiber->script);
+    fiber->script = NULL;
+    fiber->code = NULL;
+    fiber->size = 0;
+}
+
+// Reuse the fiber's script if it was loaded from the same code
+static int start_task(VMFiber *fiber, VMTask *task)
+{
+    if (fiber->script == NULL || fiber->code != task->code ||
+        fiber->size != task->size)
+    {
+        unload_fiber(fiber);
+        fiber->script = vm_load(fiber->context, task->code, task->size);
+        if (fiber->script == NULL)
+            return -1;
+
+        fiber->code = task->code;
+        fiber->size = task->size;
+    }
+
+    return vm_call(fiber->script, task->start, task->return_value);
+}
+
+static void finish_task(VMTask *task, int result)
+{
+    VMScheduler *scheduler = task->scheduler;
+    pthread_mutex_lock(&scheduler->done_lock);
+    task->result = result;
+    atomic_store(&task->state, TASK_DONE);
+    if (scheduler->awaiting > 0)
+        pthread_cond_broadcast(&scheduler->done);
+    pthread_mutex_unlock(&scheduler->done_lock);
+}
+
+static void run_task(Worker *worker, VMTask *task)
+{
+    VMFiber *fiber = task->fiber;
+    int result = -1;
+
+    atomic_store(&task->state, TASK_RUNNING);
+    current_task = task;
+    if (fiber != NULL)
+    {
+        result = vm_resume(fiber->context, task->return_value);
+    }
+    else if ((fiber = take_fiber(worker)) != NULL)
+    {
+        task->fiber = fiber;
+        result = start_task(fiber, task);
+    }
+    current_task = NULL;
+
+    // The fiber stays with the task until it's finished. A wake that
+    // came in while it was still running queues it again straight away
+    if (result == VM_PENDING)
+    {
+        int expected = TASK_RUNNING;
+        if (!atomic_compare_exchange_strong(&task->state,
+            &expected, TASK_SUSPENDED))
+        {
+            atomic_store(&task->state, TASK_QUEUED);
+            enqueue(worker->scheduler, worker, task, 0);
+        }
+        return;
+    }
+
+    // Ran out of fuel, so let every other task queued here run first
+    if (result == VM_YIELDED)
+    {
+        atomic_store(&task->state, TASK_QUEUED);
+        enqueue(worker->scheduler, worker, task, 1);
+        return;
+    }
+
+    if (fiber != NULL)
+    {
+        fiber->next_idle = worker->idle;
+        worker->idle = fiber;
+    }
+    task->fiber = NULL;
+    finish_task(task, result);
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    VMScheduler *scheduler = worker->scheduler;
+
+    for (;;)
+    {
+        VMTask *task = find_task(worker);
+        if (task != NULL)
+        {
+            run_task(worker, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        atomic_fetch_add(&scheduler->sleeping, 1);
+        while (atomic_load(&scheduler->queued) == 0 && !scheduler->stopping)
+            pthread_cond_wait(&scheduler->work, &scheduler->lock);
+        atomic_fetch_sub(&scheduler->sleeping, 1);
+        int stopping = scheduler->stopping;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        if (stopping)
+            break;
+    }
+
+    return NULL;
+}
+
+static void stop_workers(VMScheduler *scheduler, int started)
+{
+    int i;
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = 1;
+    pthread_cond_broadcast(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (i = 0; i < started; i++)
+        pthread_join(scheduler->workers[i].thread, NULL);
+}
+
+VMScheduler *scheduler_create(int worker_count, int stack_size,
+    VMSetup setup)
+{
+    int i;
+    if (worker_count <= 0)
+    {
+        printf("Error: Invalid worker count %i\n", worker_count);
+        return NULL;
+    }
+
+    VMScheduler *scheduler = calloc(1, sizeof(VMScheduler));
+    scheduler->worker_count = worker_count;
+    scheduler->stack_size = stack_size;
+    scheduler->setup = setup;
+    atomic_init(&scheduler->queued, 0);
+    atomic_init(&scheduler->sleeping, 0);
+    atomic_init(&scheduler->next_worker, 0);
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->work, NULL);
+    pthread_mutex_init(&scheduler->done_lock, NULL);
+    pthread_cond_init(&scheduler->done, NULL);
+    pthread_mutex_init(&scheduler->fiber_lock, NULL);
+
+    scheduler->workers = calloc(worker_count, sizeof(Worker));
+    for (i = 0; i < worker_count; i++)
+    {
+        Worker *worker = &scheduler->workers[i];
+        worker->scheduler = scheduler;
+        worker->index = i;
+        worker->seed = 2463534242u + i * 7919u;
+        queue_init(&worker->queue);
+    }
+
+    for (i = 0; i < worker_count; i++)
+    {
+        Worker *worker = &scheduler->workers[i];
+        if (pthread_create(&worker->thread, NULL, worker_main, worker))
+        {
+            printf("Error: Could not start worker %i\n", i);
+            stop_workers(scheduler, i);
+            scheduler->worker_count = i;
+            scheduler_free(scheduler);
+            return NULL;
+        }
+    }
+
+    return scheduler;
+}
+
+void scheduler_free(VMScheduler *scheduler)
+{
+    int i;
+    if (!scheduler->stopping)
+        stop_workers(scheduler, scheduler->worker_count);
+
+    VMFiber *fiber = scheduler->fibers;
+    while (fiber != NULL)
+    {
+        VMFiber *next = fiber->next;
+        unload_fiber(fiber);
+        vm_free(fiber->context);
+        free(fiber);
+        fiber = next;
+    }
+
+    for (i = 0; i < scheduler->worker_count; i++)
+        queue_free(&scheduler->workers[i].queue);
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->work);
+    pthread_mutex_destroy(&scheduler->done_lock);
+    pthread_cond_destroy(&scheduler->done);
+    pthread_mutex_destroy(&scheduler->fiber_lock);
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+VMTask *scheduler_submit(VMScheduler *scheduler, const char *code,
+    int size, int start, char *return_value)
+{
+    VMTask *task = calloc(1, sizeof(VMTask));
+    task->scheduler = scheduler;
+    task->code = code;
+    task->size = size;
+    task->start = start;
+    task->return_value = return_value;
+    atomic_init(&task->state, TASK_QUEUED);
+
+    enqueue(scheduler, next_worker(scheduler), task, 0);
+    return task;
+}
+
+int scheduler_await(VMTask *task)
+{
+    VMScheduler *scheduler = task->scheduler;
+    pthread_mutex_lock(&scheduler->done_lock);
+    while (atomic_load(&task->state) != TASK_DONE)
+    {
+        scheduler->awaiting += 1;
+        pthread_cond_wait(&scheduler->done, &scheduler->done_lock);
+        scheduler->awaiting -= 1;
+    }
+    pthread_mutex_unlock(&scheduler->done_lock);
+
+    int result = task->result;
+    free(task);
+    return result;
+}
+
+VMTask *scheduler_current()
+{
+    return current_task;
+}
+
+void scheduler_wake(VMTask *task)
+{
+    for (;;)
+    {
+        int state = atomic_load(&task->state);
+        if (state == TASK_SUSPENDED)
+        {
+            if (atomic_compare_exchange_strong(&task->state,
+                &state, TASK_QUEUED))
+            {
+                enqueue(task->scheduler, next_worker(task->scheduler),
+                    task, 0);
+                return;
+            }
+        }
+        else if (state == TASK_RUNNING)
+        {
+            if (atomic_compare_exchange_strong(&task->state,
+                &state, TASK_WOKEN))
+            {
+                return;
+            }
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+#else
+
+VMScheduler *scheduler_create(int worker_count, int stack_size,
+    VMSetup setup)
+{
+    printf("Error: The scheduler isn't supported on this platform\n");
+    return NULL;
+}
+
+void scheduler_free(VMScheduler *scheduler)
+{
+}
+
+VMTask *scheduler_submit(VMScheduler *scheduler, const char *code,
+    int size, int start, char *return_value)
+{
+    return NULL;
+}
+
+int scheduler_await(VMTask *task)
+{
+    return -1;
+}
+
+VMTask *scheduler_current()
+{
+    return NULL;
+}
+
+void scheduler_wake(VMTask *task)
+{
+}
+
+#endif // SCHEDULER_SUPPORTED
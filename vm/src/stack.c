@@ -0,0 +1,330 @@
+#include "stack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <limits.h>
+
+#if STACK_GUARD
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static _Thread_local VMStack *current_stack = NULL;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+static struct sigaction previous_segv, previous_bus;
+
+// Faults that aren't ours go to whatever handled them before, leaving
+// our handler in place for the next stack to fault
+static void forward_fault(int signal, siginfo_t *info, void *ucontext)
+{
+    const struct sigaction *previous = 
+        signal == SIGBUS ? &previous_bus : &previous_segv;
+    if (previous->sa_flags & SA_SIGINFO)
+    {
+        previous->sa_sigaction(signal, info, ucontext);
+        return;
+    }
+    if (previous->sa_handler == SIG_IGN)
+        return;
+    if (previous->sa_handler != SIG_DFL)
+    {
+        previous->sa_handler(signal);
+        return;
+    }
+
+    // The default kills the process, which happens as soon as the
+    // raised signal is unblocked on the way out of here
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, NULL);
+    raise(signal);
+}
+
+static void handle_fault(int signal, siginfo_t *info, void *ucontext)
+{
+    VMStack *stack = current_stack;
+    char *address = (char*)info->si_addr;
+    if (stack != NULL && 
+        address >= stack->memory + stack->size && 
+        address < stack->memory + stack->heap)
+    {
+        siglongjmp(stack->fault, STACK_OVERFLOW);
+    }
+
+    // Past the end of the heap can only be a ref gone wrong
+    if (stack != NULL && 
+        address >= stack->memory + stack->heap + stack->heap_size && 
+        address < stack->memory + stack->mapped_size)
+    {
+        stack_bad_ref(stack, (int)(address - stack->memory));
+    }
+
+    forward_fault(signal, info, ucontext);
+}
+
+static void install_handler()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_segv);
+    sigaction(SIGBUS, &action, &previous_bus);
+}
+
+int stack_create(VMStack *stack, int size, int heap_size)
+{
+    int page_size = (int)sysconf(_SC_PAGESIZE);
+    int guard_size = (VM_STACK_GUARD + page_size - 1) / page_size * page_size;
+    size = (size + page_size - 1) / page_size * page_size;
+    heap_size = (heap_size + page_size - 1) / page_size * page_size;
+
+    // Anonymous pages aren't backed until they're first written to,
+    // so only the parts of the stack and heap that get used cost anything
+    int heap = size + guard_size;
+    int mapped_size = heap + heap_size + guard_size;
+    char *memory = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        printf("Error: Could not reserve a stack of %i bytes\n", size);
+        return -1;
+    }
+    mprotect(memory + size, guard_size, PROT_NONE);
+    mprotect(memory + heap + heap_size, guard_size, PROT_NONE);
+
+    stack->memory = memory;
+    stack->size = size;
+    stack->mapped_size = mapped_size;
+    stack->heap = heap;
+    stack->heap_size = heap_size;
+    stack->heap_top = heap;
+    stack->frame = 0;
+    stack->views = NULL;
+    stack->view_count = 0;
+    stack->view_capacity = 0;
+    pthread_once(&handler_once, install_handler);
+    return 0;
+}
+
+void stack_free(VMStack *stack)
+{
+    if (stack->memory != NULL)
+        munmap(stack->memory, stack->mapped_size);
+    stack->memory = NULL;
+    free(stack->views);
+    stack->views = NULL;
+    stack->view_count = 0;
+}
+
+void stack_enter(VMStack *stack)
+{
+    stack->frame = 0;
+    current_stack = stack;
+}
+
+void stack_leave()
+{
+    current_stack = NULL;
+}
+
+void stack_recover()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGSEGV);
+    sigaddset(&signals, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+}
+
+void stack_bad_ref(VMStack *stack, int ref)
+{
+    stack->bad_ref = ref;
+    siglongjmp(stack->fault, STACK_BAD_REF);
+}
+
+void stack_out_of_heap(VMStack *stack)
+{
+    siglongjmp(stack->fault, STACK_OUT_OF_HEAP);
+}
+
+void stack_overflow(VMStack *stack)
+{
+    siglongjmp(stack->fault, STACK_OVERFLOW);
+}
+
+#else
+
+int stack_create(VMStack *stack, int size, int heap_size)
+{
+    stack->memory = malloc(size + heap_size);
+    stack->size = size;
+    stack->mapped_size = size + heap_size;
+    stack->heap = size;
+    stack->heap_size = heap_size;
+    stack->heap_top = size;
+    stack->frame = 0;
+    stack->views = NULL;
+    stack->view_count = 0;
+    stack->view_capacity = 0;
+    return stack->memory == NULL ? -1 : 0;
+}
+
+void stack_free(VMStack *stack)
+{
+    free(stack->memory);
+    stack->memory = NULL;
+    free(stack->views);
+    stack->views = NULL;
+    stack->view_count = 0;
+}
+
+void stack_enter(VMStack *stack)
+{
+    stack->frame = 0;
+}
+
+void stack_leave()
+{
+}
+
+void stack_recover()
+{
+}
+
+void stack_bad_ref(VMStack *stack, int ref)
+{
+    stack->bad_ref = ref;
+}
+
+void stack_out_of_heap(VMStack *stack)
+{
+}
+
+void stack_overflow(VMStack *stack)
+{
+}
+
+#endif // STACK_GUARD
+
+int stack_depth(const VMStack *stack)
+{
+    // Each frame starts with the base pointer of the one below it, 
+    // down to the entry function's which saved a zero
+    int bp = stack->frame;
+    int depth = 0;
+    while (bp >= 4 && bp <= stack->size)
+    {
+        int below;
+        memcpy(&below, stack->memory + bp - 4, 4);
+        if (below >= bp)
+            break;
+
+        bp = below;
+        depth += 1;
+    }
+
+    return depth;
+}
+
+int stack_new(VMStack *stack, int count, int size)
+{
+    // Every allocation starts 8 byte aligned
+    long long bytes = (long long)count * size;
+    long long end = stack->heap_top + ((bytes + 7) & ~7LL);
+    if (count < 0 || size < 0 || end > stack->heap + stack->heap_size)
+    {
+        stack->heap_request = bytes;
+        return -1;
+    }
+
+    int ref = stack->heap_top;
+    memset(stack->memory + ref, 0, bytes);
+    stack->heap_top = (int)end;
+    return ref;
+}
+
+void stack_free_heap(VMStack *stack)
+{
+    stack->heap_top = stack->heap;
+}
+
+int stack_map(VMStack *stack, void *data, int size)
+{
+    // Keep views 16 byte aligned, so any value in one lines up as it 
+    // would on the stack, and a guard region's worth of refs from the 
+    // stack and each other, so running off either end of one is caught 
+    // rather than landing in the next
+    int ref = (stack->mapped_size + VM_STACK_GUARD + 15) & ~15;
+    int i;
+    for (i = 0; i < stack->view_count; i++)
+    {
+        const VMView *view = &stack->views[i];
+        if (size >= 0 && size <= view->ref - VM_STACK_GUARD - ref)
+            break;
+        if (view->size > INT_MAX - VM_STACK_GUARD - 15 - view->ref)
+            return -1;
+        ref = (view->ref + view->size + VM_STACK_GUARD + 15) & ~15;
+    }
+
+    if (size < 0 || size > INT_MAX - ref)
+        return -1;
+
+    if (stack->view_count >= stack->view_capacity)
+    {
+        stack->view_capacity = stack->view_capacity ? 
+            stack->view_capacity * 2 : 8;
+        stack->views = realloc(stack->views, 
+            stack->view_capacity * sizeof(VMView));
+    }
+
+    memmove(stack->views + i + 1, stack->views + i, 
+        (stack->view_count - i) * sizeof(VMView));
+    stack->views[i].data = data;
+    stack->views[i].ref = ref;
+    stack->views[i].size = size;
+    stack->view_count += 1;
+    return ref;
+}
+
+int stack_unmap(VMStack *stack, int ref)
+{
+    int i;
+    for (i = 0; i < stack->view_count; i++)
+    {
+        if (stack->views[i].ref != ref)
+            continue;
+
+        memmove(stack->views + i, stack->views + i + 1, 
+            (stack->view_count - i - 1) * sizeof(VMView));
+        stack->view_count -= 1;
+        return 0;
+    }
+
+    return -1;
+}
+
+char *stack_view(const VMStack *stack, int ref, int size)
+{
+    // Scripts tend to map a handful of buffers, so a scan is as quick
+    // as anything fancier
+    int i;
+    for (i = 0; i < stack->view_count; i++)
+    {
+        const VMView *view = &stack->views[i];
+        if (ref < view->ref)
+            break;
+        if (ref - view->ref <= view->size - size && size >= 0)
+            return view->data + (ref - view->ref);
+    }
+
+    return NULL;
+}
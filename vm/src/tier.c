@@ -0,0 +1,165 @@
+#include "tier.h"
+#include "bytecode.h"
+#include "flags.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <memory.h>
+
+// Fusion is skipped over if it's turned off, and native code if the
+// function can't be compiled
+static unsigned long long next_threshold(VMTiers *tiers, int function)
+{
+    switch (tiers->tiers[function])
+    {
+        case VM_TIER_DECODED:
+#if VM_FUSION
+            return tiers->fuse_threshold;
+#endif
+        case VM_TIER_FUSED:
+#if JIT_SUPPORTED
+            if (tiers->jit->compilable[function])
+                return tiers->jit_threshold;
+#endif
+        default:
+            return ULLONG_MAX;
+    }
+}
+
+static void add_promotion(VMTiers *tiers, int function, VMTier tier)
+{
+    tiers->promotions = realloc(tiers->promotions,
+        (tiers->promotion_count + 1) * sizeof(VMPromotion));
+
+    VMPromotion *promotion = &tiers->promotions[tiers->promotion_count++];
+    promotion->offset = tiers->program->offsets[function];
+    promotion->tier = tier;
+    promotion->calls = tiers->calls[function];
+    promotion->back_edges = tiers->back_edges[function];
+    tiers->tiers[function] = tier;
+    tiers->next[function] = next_threshold(tiers, function);
+
+#if DEBUG_VM
+    printf("Promoted function at %i to tier %i\n", function, tier);
+#endif
+}
+
+void tier_init(VMTiers *tiers, VMProgram *program, VMJit *jit,
+    int fuse_threshold, int jit_threshold)
+{
+    int size = program->size;
+    int i, start = -1;
+
+    tiers->program = program;
+    tiers->jit = jit;
+    tiers->fuse_threshold = fuse_threshold;
+    tiers->jit_threshold = jit_threshold;
+    tiers->calls = calloc(size, sizeof(unsigned long long));
+    tiers->back_edges = calloc(size, sizeof(unsigned long long));
+    tiers->next = malloc(size * sizeof(unsigned long long));
+    tiers->tiers = calloc(size, 1);
+    tiers->ends = malloc(size * sizeof(int));
+    tiers->promotions = NULL;
+    tiers->promotion_count = 0;
+
+    for (i = 0; i < size; i++)
+    {
+        VMInstr *instr = &program->code[i];
+        if (instr->op == BC_CREATE_FRAME)
+        {
+            if (start != -1)
+                tiers->ends[start] = i;
+            start = i;
+        }
+
+        tiers->next[i] = next_threshold(tiers, i);
+        if (instr->op == BC_JUMP)
+            instr->b = (start != -1 && instr->a <= i) ? start : -1;
+    }
+
+    if (start != -1)
+        tiers->ends[start] = size;
+}
+
+void tier_promote(VMTiers *tiers, int function)
+{
+    unsigned long long hotness = 
+        tiers->calls[function] + tiers->back_edges[function];
+
+    // A function with no tier left is never promoted again, however 
+    // hot it gets
+    while (tiers->next[function] != ULLONG_MAX && 
+        hotness >= tiers->next[function])
+    {
+        if (tiers->tiers[function] == VM_TIER_DECODED && VM_FUSION)
+        {
+            // Fused code is fine to switch to straight away, as it
+            // still runs the same records
+            program_fuse(tiers->program, function, tiers->ends[function]);
+            add_promotion(tiers, function, VM_TIER_FUSED);
+            continue;
+        }
+
+#if JIT_SUPPORTED
+        // Native code is entered from the next call, or the next time 
+        // round a loop, the interpreter picks it up from there
+        if (jit_compile(tiers->jit, function) == 0)
+        {
+            int i;
+            add_promotion(tiers, function, VM_TIER_NATIVE);
+            for (i = 0; i < tiers->program->size; i++)
+            {
+                if (tiers->jit->natives[i] && tiers->tiers[i] != VM_TIER_NATIVE)
+                    add_promotion(tiers, i, VM_TIER_NATIVE);
+            }
+            continue;
+        }
+#endif
+
+        tiers->next[function] = ULLONG_MAX;
+    }
+}
+
+void tier_report(const VMTiers *tiers, VMTierStats *stats)
+{
+    const VMProgram *program = tiers->program;
+    int i, count = 0;
+
+    free(stats->functions);
+    free(stats->promotions);
+    stats->fuse_threshold = tiers->fuse_threshold;
+    stats->jit_threshold = tiers->jit_threshold;
+    stats->functions = NULL;
+    for (i = 0; i < program->size; i++)
+    {
+        if (program_original_op(program->code[i].op) != BC_CREATE_FRAME)
+            continue;
+
+        stats->functions = realloc(stats->functions,
+            (count + 1) * sizeof(VMFunctionStats));
+
+        VMFunctionStats *function = &stats->functions[count++];
+        function->offset = program->offsets[i];
+        function->calls = tiers->calls[i];
+        function->back_edges = tiers->back_edges[i];
+        function->tier = tiers->tiers[i];
+    }
+    stats->function_count = count;
+
+    int promotions_size = tiers->promotion_count * sizeof(VMPromotion);
+    stats->promotions = malloc(promotions_size);
+    memcpy(stats->promotions, tiers->promotions, promotions_size);
+    stats->promotion_count = tiers->promotion_count;
+}
+
+void tier_free(VMTiers *tiers)
+{
+    free(tiers->calls);
+    free(tiers->back_edges);
+    free(tiers->next);
+    free(tiers->tiers);
+    free(tiers->ends);
+    free(tiers->promotions);
+    tiers->promotions = NULL;
+    tiers->promotion_count = 0;
+}
@@ -0,0 +1,429 @@
+#include "verify.h"
+#include "bytecode.h"
+#include "stack.h"
+#include "flags.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Anything bigger than this is taken to be a bad operand rather than
+// real code, which also keeps the sums below from overflowing
+#define MAX_STACK_USE (1 << 28)
+
+typedef struct StackEffect
+{
+    int pop;
+    int push;
+} StackEffect;
+
+// Frame slots each register code reads and writes, right is left at
+// zero where it's an immediate
+typedef struct RegisterSlots
+{
+    int dst;
+    int left;
+    int right;
+} RegisterSlots;
+
+typedef struct Verifier
+{
+    VMProgram *program;
+    const int *external_args;
+    int external_count;
+
+    // Arg size of each function, by the index of its CREATE_FRAME
+    int *args;
+
+    // Stack height on entry to each instruction past its function's
+    // frame, or -1 if it's not been reached yet
+    int *heights;
+    int *work;
+} Verifier;
+
+#define OPERATION_EFFECTS(types, left, right, res) \
+    [BC_ADD_##types] = { sizeof(left) + sizeof(right), sizeof(res) }, \
+    [BC_SUB_##types] = { sizeof(left) + sizeof(right), sizeof(res) }, \
+    [BC_MUL_##types] = { sizeof(left) + sizeof(right), sizeof(res) }, \
+    [BC_DIV_##types] = { sizeof(left) + sizeof(right), sizeof(res) }, \
+    [BC_MORE_THAN_##types] = { sizeof(left) + sizeof(right), 1 }, \
+    [BC_LESS_THAN_##types] = { sizeof(left) + sizeof(right), 1 }, \
+    [BC_MORE_THAN_EQUALS_##types] = { sizeof(left) + sizeof(right), 1 }, \
+    [BC_LESS_THAN_EQUALS_##types] = { sizeof(left) + sizeof(right), 1 }, \
+    [BC_EQUALS_##types] = { sizeof(left) + sizeof(right), 1 },
+
+#define CAST_EFFECTS(name, to) \
+    [BC_CAST_INT_##name] = { sizeof(int), sizeof(to) }, \
+    [BC_CAST_FLOAT_##name] = { sizeof(float), sizeof(to) }, \
+    [BC_CAST_CHAR_##name] = { sizeof(char), sizeof(to) }, \
+    [BC_CAST_BOOL_##name] = { sizeof(char), sizeof(to) },
+
+// Effects of the codes that don't depend on their operands, the rest
+// are worked out in find_effect. Register codes leave the stack alone
+static const StackEffect fixed_effects[BC_SIZE] =
+{
+    [BC_PUSH_1] = { 0, 1 },
+    [BC_PUSH_4] = { 0, 4 },
+    [BC_STORE_LOCAL_1] = { 1, 0 },
+    [BC_STORE_LOCAL_4] = { 4, 0 },
+    [BC_STORE_LOCAL_8] = { 8, 0 },
+    [BC_LOAD_LOCAL_1] = { 0, 1 },
+    [BC_LOAD_LOCAL_4] = { 0, 4 },
+    [BC_LOAD_LOCAL_8] = { 0, 8 },
+    [BC_LOCAL_REF] = { 0, 4 },
+    [BC_JUMP_IF_NOT] = { 1, 0 },
+    [BC_NEW] = { 4, 4 },
+    OPERATION_EFFECTS(INT_INT, int, int, int)
+    OPERATION_EFFECTS(INT_FLOAT, int, float, float)
+    OPERATION_EFFECTS(INT_CHAR, int, char, int)
+    OPERATION_EFFECTS(FLOAT_INT, float, int, float)
+    OPERATION_EFFECTS(FLOAT_FLOAT, float, float, float)
+    OPERATION_EFFECTS(FLOAT_CHAR, float, char, float)
+    OPERATION_EFFECTS(CHAR_INT, char, int, int)
+    OPERATION_EFFECTS(CHAR_FLOAT, char, float, float)
+    OPERATION_EFFECTS(CHAR_CHAR, char, char, char)
+    CAST_EFFECTS(INT, int)
+    CAST_EFFECTS(FLOAT, float)
+    CAST_EFFECTS(CHAR, char)
+    CAST_EFFECTS(BOOL, char)
+};
+
+#define REGISTER_SLOTS(types, left, right, res) \
+    [BC_ADD_##types##_R] = { sizeof(res), sizeof(left), sizeof(right) }, \
+    [BC_SUB_##types##_R] = { sizeof(res), sizeof(left), sizeof(right) }, \
+    [BC_MUL_##types##_R] = { sizeof(res), sizeof(left), sizeof(right) }, \
+    [BC_DIV_##types##_R] = { sizeof(res), sizeof(left), sizeof(right) }, \
+    [BC_MORE_THAN_##types##_R] = { 1, sizeof(left), sizeof(right) }, \
+    [BC_LESS_THAN_##types##_R] = { 1, sizeof(left), sizeof(right) }, \
+    [BC_MORE_THAN_EQUALS_##types##_R] = { 1, sizeof(left), sizeof(right) }, \
+    [BC_LESS_THAN_EQUALS_##types##_R] = { 1, sizeof(left), sizeof(right) }, \
+    [BC_EQUALS_##types##_R] = { 1, sizeof(left), sizeof(right) },
+
+#define IMMEDIATE_SLOTS(types, left, res) \
+    [BC_ADD_##types##_I] = { sizeof(res), sizeof(left), 0 }, \
+    [BC_SUB_##types##_I] = { sizeof(res), sizeof(left), 0 }, \
+    [BC_MUL_##types##_I] = { sizeof(res), sizeof(left), 0 }, \
+    [BC_DIV_##types##_I] = { sizeof(res), sizeof(left), 0 }, \
+    [BC_MORE_THAN_##types##_I] = { 1, sizeof(left), 0 }, \
+    [BC_LESS_THAN_##types##_I] = { 1, sizeof(left), 0 }, \
+    [BC_MORE_THAN_EQUALS_##types##_I] = { 1, sizeof(left), 0 }, \
+    [BC_LESS_THAN_EQUALS_##types##_I] = { 1, sizeof(left), 0 }, \
+    [BC_EQUALS_##types##_I] = { 1, sizeof(left), 0 },
+
+static const RegisterSlots register_slots[BC_SIZE] =
+{
+    [BC_MOVE_1] = { 1, 1, 0 },
+    [BC_MOVE_4] = { 4, 4, 0 },
+    [BC_MOVE_CONST_1] = { 1, 0, 0 },
+    [BC_MOVE_CONST_4] = { 4, 0, 0 },
+    REGISTER_SLOTS(INT_INT, int, int, int)
+    REGISTER_SLOTS(INT_FLOAT, int, float, float)
+    REGISTER_SLOTS(INT_CHAR, int, char, int)
+    REGISTER_SLOTS(FLOAT_INT, float, int, float)
+    REGISTER_SLOTS(FLOAT_FLOAT, float, float, float)
+    REGISTER_SLOTS(FLOAT_CHAR, float, char, float)
+    REGISTER_SLOTS(CHAR_CHAR, char, char, char)
+    IMMEDIATE_SLOTS(INT_INT, int, int)
+};
+
+static int fail(const Verifier *verifier, int at, const char *problem)
+{
+    printf("Error: %s at %i\n", problem, verifier->program->offsets[at]);
+    return -1;
+}
+
+static int is_size(int size)
+{
+    return size >= 0 && size <= MAX_STACK_USE;
+}
+
+// Gives how much the instruction pops and pushes, or -1 if its sizes
+// are out of range
+static int find_effect(const Verifier *verifier, const VMInstr *instr,
+    StackEffect *effect)
+{
+    *effect = fixed_effects[instr->op];
+    switch (instr->op)
+    {
+        case BC_PUSH_X: effect->push = instr->a; break;
+        case BC_POP: effect->pop = instr->a; break;
+        case BC_ALLOC: effect->push = instr->a; break;
+        case BC_STORE_LOCAL_X: effect->pop = instr->a; break;
+        case BC_LOAD_LOCAL_X: effect->push = instr->a; break;
+        case BC_ASSIGN_REF_X: effect->pop = instr->a + 4; break;
+        case BC_RETURN: effect->pop = instr->a; break;
+
+        case BC_COPY:
+            effect->pop = 4;
+            effect->push = instr->a;
+            break;
+
+        case BC_GET_ARRAY_INDEX:
+            if (instr->b < 0 || instr->b > instr->a)
+                return -1;
+            effect->pop = instr->a + 4;
+            effect->push = instr->b;
+            break;
+
+        case BC_GET_ATTR:
+            if (instr->a < 0 || instr->b < 0 || instr->c < 0 ||
+                (long long)instr->a + instr->b > instr->c)
+            {
+                return -1;
+            }
+            effect->pop = instr->c;
+            effect->push = instr->b;
+            break;
+
+        // The return slot is allocated before the args are pushed, and
+        // is left when the args are popped
+        case BC_CALL:
+            effect->pop = verifier->args[instr->a];
+            break;
+
+        case BC_CALL_EXTERNAL:
+            effect->pop = verifier->external_args[instr->a];
+            break;
+    }
+
+    return is_size(effect->pop) && is_size(effect->push) ? 0 : -1;
+}
+
+// Frame slots are either the function's args, which sit below the
+// saved base pointer and return index, or anything from the base
+// pointer up to the top of the stack
+static int is_slot(int offset, int size, int args, int top)
+{
+    long long end = (long long)offset + size;
+    if (size < 0)
+        return 0;
+    return (offset >= 0 && end <= top) || (offset >= -8 - args && end <= -8);
+}
+
+static int check_slots(const Verifier *verifier, const VMInstr *instr,
+    int args, int top)
+{
+    RegisterSlots slots = register_slots[instr->op];
+    switch (instr->op)
+    {
+        case BC_STORE_LOCAL_1: case BC_LOAD_LOCAL_1:
+            return is_slot(instr->a, 1, args, top);
+        case BC_STORE_LOCAL_4: case BC_LOAD_LOCAL_4:
+            return is_slot(instr->a, 4, args, top);
+
+        // What a reference is used for isn't known until it's used, so 
+        // only where it starts can be checked
+        case BC_LOCAL_REF:
+            return is_slot(instr->a, 0, args, top);
+        case BC_STORE_LOCAL_8: case BC_LOAD_LOCAL_8:
+            return is_slot(instr->a, 8, args, top);
+        case BC_STORE_LOCAL_X: case BC_LOAD_LOCAL_X:
+            return is_slot(instr->b, instr->a, args, top);
+        case BC_MOVE_X:
+            return is_slot(instr->a, instr->c, args, top) &&
+                is_slot(instr->b, instr->c, args, top);
+        case BC_JUMP_IF_NOT_R:
+            return is_slot(instr->b, 1, args, top);
+    }
+
+    if (slots.dst == 0)
+        return 1;
+    return is_slot(instr->a, slots.dst, args, top) &&
+        (slots.left == 0 || is_slot(instr->b, slots.left, args, top)) &&
+        (slots.right == 0 || is_slot(instr->c, slots.right, args, top));
+}
+
+static int is_jump(int op)
+{
+    return op == BC_JUMP || op == BC_JUMP_IF_NOT || op == BC_JUMP_IF_NOT_R;
+}
+
+static int falls_through(int op)
+{
+    return op != BC_JUMP && op != BC_RETURN;
+}
+
+// Work out the stack height everywhere in the function by following
+// every path through it from the top
+static int verify_function(Verifier *verifier, int start, int end)
+{
+    VMProgram *program = verifier->program;
+    VMInstr *frame = &program->code[start];
+    int args = verifier->args[start];
+    int *heights = verifier->heights;
+    int *work = verifier->work;
+    int work_size = 0, max_height = 0;
+    int i;
+
+    if (!is_size(frame->a))
+        return fail(verifier, start, "Invalid frame size");
+    if (start + 1 >= end)
+        return fail(verifier, start, "Empty function");
+
+    for (i = start + 1; i < end; i++)
+        heights[i] = -1;
+    heights[start + 1] = 0;
+    work[work_size++] = start + 1;
+
+    while (work_size > 0)
+    {
+        int at = work[--work_size];
+        const VMInstr *instr = &program->code[at];
+        int height = heights[at];
+        StackEffect effect;
+        int next[2], next_count = 0;
+
+        if (find_effect(verifier, instr, &effect))
+            return fail(verifier, at, "Invalid operand size");
+        if (effect.pop > height)
+            return fail(verifier, at, "Stack underflow");
+        if (!check_slots(verifier, instr, args, frame->a + height))
+            return fail(verifier, at, "Frame slot out of bounds");
+
+        height += effect.push - effect.pop;
+        if (height > MAX_STACK_USE)
+            return fail(verifier, at, "Too much stack used");
+        if (height + effect.pop > max_height)
+            max_height = height + effect.pop;
+
+        if (is_jump(instr->op))
+        {
+            if (instr->a <= start || instr->a >= end)
+                return fail(verifier, at, "Jump out of function");
+            next[next_count++] = instr->a;
+        }
+        if (falls_through(instr->op))
+        {
+            if (at + 1 >= end)
+                return fail(verifier, at, "Code runs off the end of function");
+            next[next_count++] = at + 1;
+        }
+
+        for (i = 0; i < next_count; i++)
+        {
+            if (heights[next[i]] == -1)
+            {
+                heights[next[i]] = height;
+                work[work_size++] = next[i];
+            }
+            else if (heights[next[i]] != height)
+            {
+                return fail(verifier, next[i],
+                    "Stack height differs between paths");
+            }
+        }
+    }
+
+    // The frame only needs checking if it could reach past the guard
+    // region, leaving room for the saved base pointer and return index
+    frame->b = frame->a + max_height;
+    frame->c = !STACK_GUARD || frame->b + 8 > VM_STACK_GUARD;
+    return 0;
+}
+
+// Every function has to return, if only from the return the compiler
+// adds to the end, and every return gives the same arg size
+static int find_args(Verifier *verifier, int start, int end)
+{
+    VMProgram *program = verifier->program;
+    int i, args = -1;
+
+    for (i = start + 1; i < end; i++)
+    {
+        const VMInstr *instr = &program->code[i];
+        if (instr->op != BC_RETURN)
+            continue;
+
+        if (args != -1 && instr->b != args)
+            return fail(verifier, i, "Return with a different arg size");
+        args = instr->b;
+    }
+
+    if (args == -1)
+        return fail(verifier, start, "Function without a return");
+    if (!is_size(args))
+        return fail(verifier, start, "Invalid arg size");
+
+    verifier->args[start] = args;
+    return 0;
+}
+
+static int next_function(const VMProgram *program, int start)
+{
+    int i;
+    for (i = start + 1; i < program->size; i++)
+        if (program->code[i].op == BC_CREATE_FRAME)
+            break;
+    return i;
+}
+
+static int check_targets(const Verifier *verifier)
+{
+    const VMProgram *program = verifier->program;
+    int i;
+
+    for (i = 0; i < program->size; i++)
+    {
+        const VMInstr *instr = &program->code[i];
+        if (instr->op == BC_CALL &&
+            program->code[instr->a].op != BC_CREATE_FRAME)
+        {
+            return fail(verifier, i, "Call to the middle of a function");
+        }
+
+        if (instr->op == BC_CALL_EXTERNAL &&
+            (instr->a < 0 || instr->a >= verifier->external_count))
+        {
+            return fail(verifier, i, "Invalid external slot");
+        }
+
+        if (instr->op >= BC_SIZE || instr->op == BC_STORE_LOCAL_W ||
+            instr->op == BC_LOAD_LOCAL_W || instr->op == BC_LOCAL_REF_W ||
+            instr->op == BC_PUSH_CONST || instr->op == BC_POP_W ||
+            instr->op == BC_ALLOC_W || instr->op == BC_COPY_W ||
+            instr->op == BC_RETURN_W)
+        {
+            return fail(verifier, i, "Invalid bytecode");
+        }
+    }
+
+    return 0;
+}
+
+int verify_program(VMProgram *program,
+    const int *external_args, int external_count)
+{
+    Verifier verifier;
+    int start, result = 0;
+
+    verifier.program = program;
+    verifier.external_args = external_args;
+    verifier.external_count = external_count;
+    if (program->size <= 0)
+        return 0;
+
+    // There's nothing to run code before the first function
+    if (program->code[0].op != BC_CREATE_FRAME)
+        return fail(&verifier, 0, "Code outside of a function");
+    if (check_targets(&verifier))
+        return -1;
+
+    verifier.args = malloc(3 * program->size * sizeof(int));
+    verifier.heights = verifier.args + program->size;
+    verifier.work = verifier.heights + program->size;
+
+    // Calls need the arg size of what they call, so find them all first
+    for (start = 0; start < program->size && !result;
+        start = next_function(program, start))
+    {
+        result = find_args(&verifier, start, next_function(program, start));
+    }
+
+    for (start = 0; start < program->size && !result;
+        start = next_function(program, start))
+    {
+        result = verify_function(&verifier, start,
+            next_function(program, start));
+    }
+
+    free(verifier.args);
+    return result;
+}
@@ -1,9 +1,19 @@
 #include "vm.h"
 #include "bytecode.h"
+#include "program.h"
+#include "jit.h"
+#include "tier.h"
+#include "stack.h"
+#include "profile.h"
+#include "debug.h"
+#include "counts.h"
+#include "verify.h"
+#include "format.h"
 #include "flags.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <limits.h>
 
 #if DEBUG_VM
 #define LOG(...) printf(__VA_ARGS__)
@@ -13,68 +23,288 @@
 
 typedef struct VMExternal
 {
-    char name[80];
+    char *name;
     VMFunc func;
+    int async;
 } VMExternal;
 
-typedef struct VMLink
+struct VMContext
 {
-    int id;
-    VMFunc func;
-} VMLink;
+    VMExternal *externals;
+    int external_size;
+    int external_buffer;
+
+    // Reused by every call
+    VMStack stack;
+
+    int fuse_threshold;
+    int jit_threshold;
+    VMTierStats tier_stats;
+
+    VMProfile profile;
+
+    // Where vm_run writes counts when it finishes, if anywhere
+    VMCounts counts;
+    char *counts_path;
+
+    // The call an async external suspended, if any, and the registers 
+    // it stopped with. Everything else it needs is on the stack. A 
+    // script loaded by vm_run is unloaded when its call finishes
+    VMScript *suspended;
+    VMState resume;
+    int resume_start;
+    VMScript *run_script;
+
+    // Limits on each call, 0 for none
+    int fuel;
+    int fuel_yields;
+    int stack_limit;
+};
+
+VMContext *vm_create(int stack_size)
+{
+    VMContext *context = calloc(1, sizeof(VMContext));
+    if (stack_create(&context->stack, stack_size, VM_HEAP_MEMORY))
+    {
+        free(context);
+        return NULL;
+    }
+
+    context->fuse_threshold = VM_TIER_FUSE_THRESHOLD;
+    context->jit_threshold = VM_TIER_JIT_THRESHOLD;
+    context->tier_stats.fuse_threshold = VM_TIER_FUSE_THRESHOLD;
+    context->tier_stats.jit_threshold = VM_TIER_JIT_THRESHOLD;
+    return context;
+}
+
+void vm_free(VMContext *context)
+{
+    int i;
+    if (context->run_script != NULL)
+        vm_unload(context->run_script);
+    for (i = 0; i < context->external_size; i++)
+        free(context->externals[i].name);
+    free(context->externals);
+    stack_free(&context->stack);
+    free(context->tier_stats.functions);
+    free(context->tier_stats.promotions);
+    profile_free(&context->profile);
+    counts_free(&context->counts);
+    free(context->counts_path);
+    free(context);
+}
+
+static void add_external(VMContext *context, const char *name, 
+    VMFunc func, int async)
+{
+    if (context->external_size >= context->external_buffer)
+    {
+        context->external_buffer = context->external_buffer ? 
+            context->external_buffer * 2 : 32;
+        context->externals = realloc(context->externals, 
+            context->external_buffer * sizeof(VMExternal));
+    }
+
+    VMExternal *external = &context->externals[context->external_size];
+    external->name = strdup(name);
+    external->func = func;
+    external->async = async;
+    context->external_size += 1;
+}
 
-static VMExternal exernals[80];
-static int external_size = 0;
+void register_external(VMContext *context, const char *name, VMFunc func)
+{
+    add_external(context, name, func, 0);
+}
 
-void vm_init()
+void register_async_external(VMContext *context, const char *name, 
+    VMFunc func)
 {
-    external_size = 0;
+    add_external(context, name, func, 1);
 }
 
-void register_external(const char *name, VMFunc func)
+void vm_suspend(VMState *state)
 {
-    strcpy(exernals[external_size].name, name);
-    exernals[external_size].func = func;
-    external_size += 1;
+    state->suspended = 1;
 }
 
-#define BYTE code[s.pc]
-#define NBYTE code[s.pc++]
-#define INT *(int*)(code + s.pc)
+static int find_external(VMContext *context, const char *name)
+{
+    int i;
+    for (i = 0; i < context->external_size; i++)
+        if (!strcmp(context->externals[i].name, name))
+            return i;
+    return -1;
+}
+
+void vm_set_tier_thresholds(VMContext *context, 
+    int fuse_threshold, int jit_threshold)
+{
+    context->fuse_threshold = fuse_threshold;
+    context->jit_threshold = jit_threshold;
+}
+
+const VMTierStats *vm_tier_stats(const VMContext *context)
+{
+    return &context->tier_stats;
+}
+
+int vm_profile_start(VMContext *context, int frequency)
+{
+    return profile_start(&context->profile, frequency);
+}
+
+void vm_profile_stop(VMContext *context)
+{
+    profile_stop(&context->profile);
+}
+
+const VMProfileStats *vm_profile_stats(const VMContext *context)
+{
+    return &context->profile.stats;
+}
+
+void vm_set_fuel(VMContext *context, int fuel, int yield)
+{
+    context->fuel = fuel > 0 ? fuel : 0;
+    context->fuel_yields = yield;
+}
+
+void vm_set_stack_limit(VMContext *context, int size)
+{
+    if (size <= 0 || size >= context->stack.size)
+        context->stack_limit = 0;
+    else
+        context->stack_limit = size;
+}
+
+void vm_counts_start(VMContext *context, const char *path)
+{
+    free(context->counts_path);
+    context->counts_path = path != NULL ? strdup(path) : NULL;
+    counts_start(&context->counts, context->external_size);
+}
+
+void vm_counts_stop(VMContext *context)
+{
+    counts_stop(&context->counts);
+}
+
+int vm_counts_write(const VMContext *context, const char *path)
+{
+    const VMCounts *counts = &context->counts;
+    if (counts->opcodes == NULL)
+    {
+        printf("Error: Nothing has been counted\n");
+        return -1;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("Error: Could not open '%s'\n", path);
+        return -1;
+    }
+
+    // Externals registered since the last script was loaded weren't 
+    // called, so there are no counts for them
+    const char **names = malloc((counts->external_size + 1) * sizeof(char*));
+    int i;
+    for (i = 0; i < counts->external_size; i++)
+        names[i] = context->externals[i].name;
+
+    counts_write(counts, file, names);
+    free(names);
+    fclose(file);
+    return 0;
+}
 
 #define MAX(a, b) (a) > (b) ? (a) : (b)
 
-#define OPERATION(ltype, op, rtype, restype) \
+// Threaded dispatch needs the GNU labels as values extension, so fall back 
+// to the plain switch loop on compilers that don't provide it
+#if VM_THREADED_DISPATCH && defined(__GNUC__)
+#define THREADED 1
+#else
+#define THREADED 0
+#endif
+
+#if DEBUG_STACK
+#define LOG_STACK() \
+    { \
+        int i; \
+        printf("Stack: "); \
+        for (i = 0; i < sp; i++) \
+            printf("%i ", stack[i]); \
+        printf("\n"); \
+    }
+#else
+#define LOG_STACK() ;
+#endif
+
+#if THREADED
+
+// Each handler jumps straight to the next one through the label table, 
+// giving every opcode its own indirect branch
+#define GENERATE_LABEL(ENUM, size) [ENUM] = &&do_##ENUM,
+#define GENERATE_FUSED_LABEL(ENUM, ...) [ENUM] = &&do_##ENUM,
+#define CASE(code) do_##code:
+#define DEFAULT
+#define DISPATCH() \
+    { \
+        LOG_STACK(); \
+        LOG("%i: ", (int)(ip - code)); \
+        in = ip++; \
+        PROFILE_IP(); \
+        COUNT_OP(); \
+        goto *dispatch_table[in->op]; \
+    }
+#define NEXT DISPATCH()
+#define HALT goto halt
+
+#else
+
+#define CASE(code) case code:
+#define DEFAULT default:
+#define NEXT break
+#define HALT running = 0; break
+
+#endif
+
+#define OPERATION_BODY(ltype, op, rtype, restype) \
     { \
         LOG("%s %s %s = %s\n", #ltype, #op, #rtype, #restype); \
-        ltype left = *(ltype*)(s.stack + s.sp - sizeof(ltype) - sizeof(rtype)); \
-        rtype right = *(rtype*)(s.stack + s.sp - sizeof(rtype)); \
+        ltype left = *(ltype*)(stack + sp - sizeof(ltype) - sizeof(rtype)); \
+        rtype right = *(rtype*)(stack + sp - sizeof(rtype)); \
         restype res = left op right; \
-        memcpy(s.stack + s.sp - sizeof(ltype) - sizeof(rtype), &res, sizeof(restype)); \
-        s.sp += sizeof(restype) - sizeof(ltype) - sizeof(rtype); \
-        break; \
+        memcpy(stack + sp - sizeof(ltype) - sizeof(rtype), &res, sizeof(restype)); \
+        sp += sizeof(restype) - sizeof(ltype) - sizeof(rtype); \
     }
 
+#define OPERATION(ltype, op, rtype, restype) \
+    OPERATION_BODY(ltype, op, rtype, restype) \
+    NEXT;
+
 #define LOGIC_SET(types, left, right) \
-    case BC_MORE_THAN_##types: OPERATION(left, >, right, char); \
-    case BC_LESS_THAN_##types: OPERATION(left, <, right, char); \
-    case BC_MORE_THAN_EQUALS_##types: OPERATION(left, >=, right, char); \
-    case BC_LESS_THAN_EQUALS_##types: OPERATION(left, <=, right, char); \
-    case BC_EQUALS_##types: OPERATION(left, ==, right, char);
+    CASE(BC_MORE_THAN_##types) OPERATION(left, >, right, char); \
+    CASE(BC_LESS_THAN_##types) OPERATION(left, <, right, char); \
+    CASE(BC_MORE_THAN_EQUALS_##types) OPERATION(left, >=, right, char); \
+    CASE(BC_LESS_THAN_EQUALS_##types) OPERATION(left, <=, right, char); \
+    CASE(BC_EQUALS_##types) OPERATION(left, ==, right, char);
 
 #define OPERATION_SET(types, left, right, res) \
-    case BC_ADD_##types: OPERATION(left, +, right, res); \
-    case BC_SUB_##types: OPERATION(left, -, right, res); \
-    case BC_MUL_##types: OPERATION(left, *, right, res); \
-    case BC_DIV_##types: OPERATION(left, /, right, res); \
+    CASE(BC_ADD_##types) OPERATION(left, +, right, res); \
+    CASE(BC_SUB_##types) OPERATION(left, -, right, res); \
+    CASE(BC_MUL_##types) OPERATION(left, *, right, res); \
+    CASE(BC_DIV_##types) OPERATION(left, /, right, res); \
     LOGIC_SET(types, left, right)
 
 #define CAST(name, from, to) \
-    case BC_CAST_##name: \
+    CASE(BC_CAST_##name) \
         LOG("Cast from %s to %s\n", #from, #to); \
-        *(to*)(s.stack + s.sp - sizeof(from)) = (to)*(from*)(s.stack + s.sp - sizeof(from)); \
-        s.sp -= MAX(sizeof(from) - sizeof(to), 0); \
-        break; \
+        *(to*)(stack + sp - sizeof(from)) = (to)*(from*)(stack + sp - sizeof(from)); \
+        sp -= MAX(sizeof(from) - sizeof(to), 0); \
+        NEXT; \
 
 #define CAST_SET(name, to) \
     CAST(INT_##name, int, to) \
@@ -82,275 +312,1199 @@ void register_external(const char *name, VMFunc func)
     CAST(CHAR_##name, char, to) \
     CAST(BOOL_##name, char, to) \
 
-static int decode_header(char *data, VMLink **links, int *link_size)
+// Register operands are byte offsets from the base pointer
+#define REG(offset) (stack + bp + (offset))
+
+#define REG_OPERATION_BODY(in, ltype, op, rtype, restype, right) \
+    { \
+        LOG("%s %s %s = %s at %i\n", #ltype, #op, #rtype, #restype, (in)->a); \
+        ltype left = *(ltype*)REG((in)->b); \
+        restype res = left op (right); \
+        memcpy(REG((in)->a), &res, sizeof(restype)); \
+    }
+
+#define REG_OPERATION(ltype, op, rtype, restype) \
+    REG_OPERATION_BODY(in, ltype, op, rtype, restype, *(rtype*)REG(in->c)) \
+    NEXT;
+
+#define IMM_OPERATION(ltype, op, restype) \
+    REG_OPERATION_BODY(in, ltype, op, int, restype, in->c) \
+    NEXT;
+
+#define REG_OPERATION_SET(types, left, right, res) \
+    CASE(BC_ADD_##types##_R) REG_OPERATION(left, +, right, res); \
+    CASE(BC_SUB_##types##_R) REG_OPERATION(left, -, right, res); \
+    CASE(BC_MUL_##types##_R) REG_OPERATION(left, *, right, res); \
+    CASE(BC_DIV_##types##_R) REG_OPERATION(left, /, right, res); \
+    CASE(BC_MORE_THAN_##types##_R) REG_OPERATION(left, >, right, char); \
+    CASE(BC_LESS_THAN_##types##_R) REG_OPERATION(left, <, right, char); \
+    CASE(BC_MORE_THAN_EQUALS_##types##_R) REG_OPERATION(left, >=, right, char); \
+    CASE(BC_LESS_THAN_EQUALS_##types##_R) REG_OPERATION(left, <=, right, char); \
+    CASE(BC_EQUALS_##types##_R) REG_OPERATION(left, ==, right, char);
+
+#define IMM_OPERATION_SET(types, left, res) \
+    CASE(BC_ADD_##types##_I) IMM_OPERATION(left, +, res); \
+    CASE(BC_SUB_##types##_I) IMM_OPERATION(left, -, res); \
+    CASE(BC_MUL_##types##_I) IMM_OPERATION(left, *, res); \
+    CASE(BC_DIV_##types##_I) IMM_OPERATION(left, /, res); \
+    CASE(BC_MORE_THAN_##types##_I) IMM_OPERATION(left, >, char); \
+    CASE(BC_LESS_THAN_##types##_I) IMM_OPERATION(left, <, char); \
+    CASE(BC_MORE_THAN_EQUALS_##types##_I) IMM_OPERATION(left, >=, char); \
+    CASE(BC_LESS_THAN_EQUALS_##types##_I) IMM_OPERATION(left, <=, char); \
+    CASE(BC_EQUALS_##types##_I) IMM_OPERATION(left, ==, char);
+
+// Handler bodies for each instruction, given the record to run. These are 
+// shared between the plain handlers and the fused ones
+#define DO_BC_PUSH_1(in) \
+    LOG("push 1b %i\n", (in)->a); \
+    stack[sp++] = (in)->a;
+
+#define DO_BC_PUSH_4(in) \
+    LOG("push 4b %i\n", (in)->a); \
+    memcpy(stack + sp, &(in)->a, 4); \
+    sp += 4;
+
+#define DO_BC_PUSH_X(in) \
+    LOG("push %ib\n", (in)->a); \
+    memcpy(stack + sp, program->data + (in)->b, (in)->a); \
+    sp += (in)->a;
+
+#define DO_BC_POP(in) \
+    LOG("pop %ib\n", (in)->a); \
+    sp -= (in)->a;
+
+#define DO_BC_ALLOC(in) \
+    LOG("alloc %ib\n", (in)->a); \
+    sp += (in)->a;
+
+#define DO_BC_STORE_LOCAL_4(in) \
+    LOG("store 4b at %i\n", (in)->a); \
+    memcpy(stack + bp + (in)->a, stack + sp - 4, 4); sp -= 4;
+
+#define DO_BC_STORE_LOCAL_X(in) \
+    LOG("store %ib at %i\n", (in)->a, (in)->b); \
+    memcpy(stack + bp + (in)->b, stack + sp - (in)->a, (in)->a); sp -= (in)->a;
+
+#define DO_BC_LOAD_LOCAL_4(in) \
+    LOG("load 4b at %i\n", (in)->a); \
+    memcpy(stack + sp, stack + bp + (in)->a, 4); sp += 4;
+
+#define DO_BC_LOAD_LOCAL_X(in) \
+    LOG("load %ib at %i\n", (in)->a, (in)->b); \
+    memcpy(stack + sp, stack + bp + (in)->b, (in)->a); sp += (in)->a;
+
+#define DO_BC_STORE_LOCAL_1(in) \
+    LOG("store 1b at %i\n", (in)->a); \
+    stack[bp + (in)->a] = stack[sp - 1]; sp -= 1;
+
+#define DO_BC_STORE_LOCAL_8(in) \
+    LOG("store 8b at %i\n", (in)->a); \
+    memcpy(stack + bp + (in)->a, stack + sp - 8, 8); sp -= 8;
+
+#define DO_BC_LOAD_LOCAL_1(in) \
+    LOG("load 1b at %i\n", (in)->a); \
+    stack[sp] = stack[bp + (in)->a]; sp += 1;
+
+#define DO_BC_LOAD_LOCAL_8(in) \
+    LOG("load 8b at %i\n", (in)->a); \
+    memcpy(stack + sp, stack + bp + (in)->a, 8); sp += 8;
+
+#define DO_BC_LOCAL_REF(in) \
+    { \
+        LOG("return ref of local at %ib\n", (in)->a); \
+        int loc = bp + (in)->a; \
+        memcpy(stack + sp, &loc, 4); sp += 4; \
+    }
+
+// Refs from the end of the guard region on are views of host memory, 
+// which are looked up and checked, anything below is the stack
+#define REF_AT(loc, size) \
+    char *at = stack + (loc); \
+    if ((unsigned int)(loc) >= view_base) \
+    { \
+        at = stack_view(&context->stack, (loc), (size)); \
+        if (at == NULL) \
+        { \
+            context->stack.bad_ref = (loc); \
+            goto bad_ref; \
+        } \
+    }
+
+#define DO_BC_COPY(in) \
+    { \
+        LOG("copy %ib\n", (in)->a); \
+        int loc = *(int*)(stack + sp - 4); sp -= 4; \
+        REF_AT(loc, (in)->a) \
+        memcpy(stack + sp, at, (in)->a); \
+        sp += (in)->a; \
+    }
+
+#define DO_BC_GET_ARRAY_INDEX(in) \
+    { \
+        LOG("Get array (size %ib, element size %ib) element at index\n", (in)->a, (in)->b); \
+        int array_size = (in)->a; \
+        int element_size = (in)->b; \
+        int index = *(int*)(stack + sp - 4); sp -= 4; \
+        memcpy(stack + sp - array_size, \
+            stack + sp - array_size + element_size * index, \
+            element_size); \
+        sp -= array_size - element_size; \
+    }
+
+#define DO_BC_GET_ATTR(in) \
+    { \
+        LOG("Get attr at %i of size %ib (type size %ib)\n", (in)->a, (in)->b, (in)->c); \
+        int offset = (in)->a; \
+        int size = (in)->b; \
+        int type_size = (in)->c; \
+        memcpy(stack + sp - type_size, stack + sp - type_size + offset, size); \
+        sp -= type_size - size; \
+    }
+
+#define DO_BC_ASSIGN_REF_X(in) \
+    { \
+        LOG("Assign ref %ib\n", (in)->a); \
+        int loc = *(int*)(stack + sp - 4); sp -= 4; \
+        REF_AT(loc, (in)->a) \
+        memcpy(at, stack + sp - (in)->a, (in)->a); sp -= (in)->a; \
+    }
+
+#define DO_BC_NEW(in) \
+    { \
+        LOG("new %i values of %ib\n", *(int*)(stack + sp - 4), (in)->a); \
+        int count = *(int*)(stack + sp - 4); \
+        int ref = stack_new(&context->stack, count, (in)->a); \
+        if (ref == -1) \
+            goto out_of_heap; \
+        memcpy(stack + sp - 4, &ref, 4); \
+    }
+
+// Frames the guard region can't catch, as they could reach past it, 
+// are checked against the stack size once when they're made
+#define DO_BC_CREATE_FRAME(in) \
+    LOG("create stack frame of size %i\n", (in)->a); \
+    memcpy(stack + sp, &bp, 4); sp += 4; \
+    bp = sp; \
+    context->stack.frame = bp; \
+    if ((in)->c && bp + (in)->b > context->stack.size) \
+        goto overflow; \
+    sp += (in)->a;
+
+#if JIT_SUPPORTED
+
+// Functions with native code run to their return straight away
+#define CALL_NATIVE(in) \
+    if (RUN_NATIVE && natives[(in)->a]) \
+    { \
+        PROFILE_NATIVE(); \
+        sp = natives[(in)->a](stack, sp, bp, jit); \
+    } \
+    else
+#else
+#define CALL_NATIVE(in)
+#endif
+
+#if VM_TIERED && JIT_SUPPORTED
+
+// Once a running loop's function has been compiled, carry on from the 
+// top of the loop in native code. That runs through to the function's 
+// return, so pick up after it the same way RETURN does
+#define ENTER_NATIVE_LOOP(in) \
+    if (RUN_NATIVE && jit->loops[(in)->a]) \
+    { \
+        int caller_bp, return_index; \
+        memcpy(&caller_bp, stack + bp - 4, 4); \
+        memcpy(&return_index, stack + bp - 8, 4); \
+        PROFILE_NATIVE(); \
+        sp = jit->loops[(in)->a](stack, sp, bp, jit); \
+        if (depth <= 0) \
+            goto native_return; \
+        bp = caller_bp; \
+        context->stack.frame = bp; \
+        ip = code + return_index; \
+        depth--; \
+    }
+#else
+#define ENTER_NATIVE_LOOP(in)
+#endif
+
+#if VM_TIERED
+
+// Count towards the function's next tier, promoting it once it's hot
+#define COUNT_CALL(in) \
+    if (++tiers->calls[(in)->a] + tiers->back_edges[(in)->a] >= \
+        tiers->next[(in)->a]) \
+    { \
+        tier_promote(tiers, (in)->a); \
+    }
+
+#define COUNT_BACK_EDGE(in) \
+    if ((in)->b >= 0 && \
+        ++tiers->back_edges[(in)->b] + tiers->calls[(in)->b] >= \
+        tiers->next[(in)->b]) \
+    { \
+        tier_promote(tiers, (in)->b); \
+        ENTER_NATIVE_LOOP(in) \
+    }
+#else
+#define COUNT_CALL(in)
+#define COUNT_BACK_EDGE(in)
+#endif
+
+#define DO_BC_CALL(in) \
+    { \
+        LOG("call function at %i\n", (in)->a); \
+        CHARGE_CALL(in) \
+        int return_index = ip - code; \
+        memcpy(stack + sp, &return_index, 4); sp += 4; \
+        COUNT_CALL(in) \
+        CALL_NATIVE(in) \
+        { \
+            ip = code + (in)->a; \
+            depth++; \
+        } \
+    }
+
+#define DO_BC_JUMP(in) \
+    LOG("Jump to %i\n", (in)->a); \
+    ip = code + (in)->a; \
+    CHARGE_BACK_EDGE(in) \
+    COUNT_BACK_EDGE(in)
+
+#define DO_BC_JUMP_IF_NOT(in) \
+    LOG("Jump if not %s to %i\n", stack[sp-1] ? "true" : "false", (in)->a); \
+    if (!stack[--sp]) \
+        ip = code + (in)->a;
+
+#define DO_BC_ADD_INT_INT(in) OPERATION_BODY(int, +, int, int)
+#define DO_BC_SUB_INT_INT(in) OPERATION_BODY(int, -, int, int)
+#define DO_BC_MUL_INT_INT(in) OPERATION_BODY(int, *, int, int)
+#define DO_BC_LESS_THAN_INT_INT(in) OPERATION_BODY(int, <, int, char)
+#define DO_BC_MORE_THAN_INT_INT(in) OPERATION_BODY(int, >, int, char)
+
+#define DO_BC_MOVE_1(in) \
+    LOG("move 1b from %i to %i\n", (in)->b, (in)->a); \
+    *REG((in)->a) = *REG((in)->b);
+
+#define DO_BC_MOVE_4(in) \
+    LOG("move 4b from %i to %i\n", (in)->b, (in)->a); \
+    memcpy(REG((in)->a), REG((in)->b), 4);
+
+#define DO_BC_MOVE_X(in) \
+    LOG("move %ib from %i to %i\n", (in)->c, (in)->b, (in)->a); \
+    memmove(REG((in)->a), REG((in)->b), (in)->c);
+
+#define DO_BC_MOVE_CONST_1(in) \
+    LOG("move const 1b %i to %i\n", (in)->b, (in)->a); \
+    *REG((in)->a) = (in)->b;
+
+#define DO_BC_MOVE_CONST_4(in) \
+    LOG("move const 4b %i to %i\n", (in)->b, (in)->a); \
+    memcpy(REG((in)->a), &(in)->b, 4);
+
+#define DO_BC_JUMP_IF_NOT_R(in) \
+    LOG("Jump if not %s to %i\n", *REG((in)->b) ? "true" : "false", (in)->a); \
+    if (!*REG((in)->b)) \
+        ip = code + (in)->a;
+
+#define DO_BC_LESS_THAN_INT_INT_R(in) \
+    REG_OPERATION_BODY(in, int, <, int, char, *(int*)REG((in)->c))
+#define DO_BC_MORE_THAN_INT_INT_R(in) \
+    REG_OPERATION_BODY(in, int, >, int, char, *(int*)REG((in)->c))
+#define DO_BC_LESS_THAN_INT_INT_I(in) \
+    REG_OPERATION_BODY(in, int, <, int, char, (in)->c)
+#define DO_BC_MORE_THAN_INT_INT_I(in) \
+    REG_OPERATION_BODY(in, int, >, int, char, (in)->c)
+#define DO_BC_ADD_INT_INT_I(in) \
+    REG_OPERATION_BODY(in, int, +, int, int, (in)->c)
+
+#define HANDLER(code) CASE(code) DO_##code(in) NEXT;
+
+// Run each code of the sequence in turn against its own record, the pc is 
+// moved past the whole sequence first so the last code can jump or call
+#define FUSED_BODY_2(a, b) DO_##a(in) DO_##b(in + 1)
+#define FUSED_BODY_3(a, b, c) FUSED_BODY_2(a, b) DO_##c(in + 2)
+#define FUSED_BODY_4(a, b, c, d) FUSED_BODY_3(a, b, c) DO_##d(in + 3)
+#define FUSED_BODY_5(a, b, c, d, e) FUSED_BODY_4(a, b, c, d) DO_##e(in + 4)
+#define FUSED_BODY_(length, ...) FUSED_BODY_##length(__VA_ARGS__)
+#define FUSED_BODY(length, ...) FUSED_BODY_(length, __VA_ARGS__)
+
+#define GENERATE_FUSED_HANDLER(code, ...) \
+    CASE(code) \
+        LOG("fused %s\n", #code); \
+        ip += FUSED_LENGTH(__VA_ARGS__) - 1; \
+        FUSED_BODY(FUSED_LENGTH(__VA_ARGS__), __VA_ARGS__) \
+        NEXT;
+
+// Rows of a batch run one after the other in the same call, each one's 
+// args loaded in under the entry frame as the last one returns
+typedef struct VMBatch
+{
+    VMColumn *columns;
+    int column_count;
+    int column_capacity;
+    char *results;
+    int row;
+    int row_count;
+} VMBatch;
+
+struct VMScript
+{
+    VMContext *context;
+    VMProgram program;
+    VMFunc *links;
+    int *link_ids;
+    int *link_args;
+    char *link_async;
+    int link_size;
+    int entry;
+    VMJit jit;
+    VMTiers tiers;
+    VMDebug debug;
+
+    // Exports are found by name through an open addressed hash table of 
+    // indices into them, plus one so zero is empty
+    VMFunction *exports;
+    int export_count;
+    int *export_table;
+    int export_mask;
+
+    // The call being given its args, and how many bytes of them are left
+    const VMFunction *call;
+    int arg_space;
+
+    // Only has rows while a batch is running
+    VMBatch batch;
+
+    // Sizes of the last function called, found by scanning it
+    int last_start;
+    int last_return_size;
+    int last_arg_size;
+};
+
+static char *copy_name(const char *name, int length)
 {
-    int pc = 0, i, j;
-    int external_count = data[pc++];
-    char name[80];
+    char *copy = malloc(length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Counts are checked against the bytes left, as every entry takes at
+// least 8, so a bad count can't ask for a huge allocation
+static int read_count(VMReader *reader)
+{
+    int count = format_read_int(reader);
+    if (count < 0 || count > (reader->size - reader->pos) / 8)
+        reader->error = 1;
+    return reader->error ? 0 : count;
+}
+
+// Resolve every external the code imports into a table indexed by its 
+// slot, so calls don't need to search for them. Which external each 
+// slot is is kept too, for counting calls to it, and the size of its 
+// args, for the verifier
+static int read_imports(VMContext *context, VMScript *script, 
+    const VMSection *section)
+{
+    VMReader reader;
+    int i, length;
+
+    format_reader(&reader, section);
+    int count = read_count(&reader);
+    script->link_size = count;
+    script->links = malloc(count * sizeof(VMFunc));
+    script->link_ids = malloc(count * sizeof(int));
+    script->link_args = malloc(count * sizeof(int));
+    script->link_async = malloc(count);
+    for (i = 0; i < count; i++)
+    {
+        int arg_size = format_read_int(&reader);
+        const char *name = format_read_name(&reader, &length);
+        if (reader.error)
+            break;
 
-    *link_size = external_count;
-    *links = malloc(external_count * sizeof(VMLink));
+        char *external_name = copy_name(name, length);
+        int external = find_external(context, external_name);
+        LOG("Linking external '%s' to slot %i\n", external_name, i);
+        if (external == -1)
+        {
+            printf("Error: Could not find external '%s'\n", external_name);
+            free(external_name);
+            return -1;
+        }
+        free(external_name);
 
-    for (i = 0; i < external_count; i++)
+        script->links[i] = context->externals[external].func;
+        script->link_ids[i] = external;
+        script->link_args[i] = arg_size;
+        script->link_async[i] = context->externals[external].async;
+    }
+
+    if (reader.error)
     {
-        VMLink link;
+        printf("Error: Invalid import section\n");
+        return -1;
+    }
 
-        link.id = *(int*)(data + pc); pc += 4;
-        int name_len = data[pc++];
-        for (j = 0; j < name_len; j++)
-            name[j] = data[pc++];
-        name[name_len] = '\0';
-        LOG("Searching for external '%s' with id %i", name, link.id);
+    return 0;
+}
 
-        int found = 0;
-        for (j = 0; j < external_size; j++)
+// Every return from a function pops the same args, and the largest 
+// value returned is the one its callers make room for
+static void function_sizes(const VMProgram *program, int start, 
+    int *return_size, int *arg_size)
+{
+    int i;
+    *return_size = 0;
+    *arg_size = 0;
+    for (i = start + 1; i < program->size; i++)
+    {
+        const VMInstr *instr = &program->code[i];
+        if (instr->op == BC_CREATE_FRAME)
+            break;
+        if (instr->op == BC_RETURN)
         {
-            if (!strcmp(exernals[j].name, name))
-            {
-                link.func = exernals[j].func;
-                found = 1;
-                break;
-            }
+            *return_size = MAX(*return_size, instr->a);
+            *arg_size = instr->b;
         }
+    }
+}
 
-        (*links)[i] = link;
-        if (!found)
+// FNV-1a
+static unsigned int hash_name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void hash_exports(VMScript *script)
+{
+    int i, size = 1;
+    while (size < script->export_count * 2)
+        size *= 2;
+
+    script->export_table = calloc(size, sizeof(int));
+    script->export_mask = size - 1;
+    for (i = 0; i < script->export_count; i++)
+    {
+        unsigned int slot = hash_name(script->exports[i].name);
+        while (script->export_table[slot & script->export_mask])
+            slot += 1;
+        script->export_table[slot & script->export_mask] = i + 1;
+    }
+}
+
+// Each export has to be the start of a function, and is kept with the 
+// sizes a call to it lays out. Code from before version 2 doesn't give 
+// return types
+static int read_exports(VMScript *script, const VMSection *section, 
+    int version)
+{
+    const VMProgram *program = &script->program;
+    VMReader reader;
+    int i, length;
+
+    format_reader(&reader, section);
+    int count = read_count(&reader);
+    script->exports = calloc(count, sizeof(VMFunction));
+    for (i = 0; i < count; i++)
+    {
+        VMFunction *export = &script->exports[i];
+        export->offset = format_read_int(&reader);
+        const char *name = format_read_name(&reader, &length);
+        if (reader.error)
+            break;
+
+        script->export_count += 1;
+        export->name = copy_name(name, length);
+        if (version >= 2)
         {
-            LOG("\nError: Could not find external '%s'\n", name);
+            const char *type = format_read_name(&reader, &length);
+            if (reader.error)
+                break;
+            export->return_type = copy_name(type, length);
         }
-        else
+
+        int index = program_find(program, export->offset);
+        if (index == -1 || program->code[index].op != BC_CREATE_FRAME)
         {
-            LOG(" [Found]\n");
+            printf("Error: Export '%s' isn't a function\n", export->name);
+            return -1;
         }
+
+        export->start_index = index;
+        function_sizes(program, index, 
+            &export->return_size, &export->arg_size);
     }
 
-    return pc;
+    if (reader.error)
+    {
+        printf("Error: Invalid export section\n");
+        return -1;
+    }
+
+    hash_exports(script);
+    return 0;
 }
 
-int vm_run(char *data, int start, char *return_value)
+static void free_script(VMScript *script)
 {
+    int i;
+    for (i = 0; i < script->export_count; i++)
+    {
+        free((char*)script->exports[i].name);
+        free((char*)script->exports[i].return_type);
+    }
+    free(script->exports);
+    free(script->export_table);
+    free(script->batch.columns);
+    free(script->links);
+    free(script->link_ids);
+    free(script->link_args);
+    free(script->link_async);
+    program_free(&script->program);
+    debug_free(&script->debug);
+    free(script);
+}
 
-    VMState s;
-    s.pc = start;
-    s.sp = 0;
-    s.bp = 0;
-    s.depth = 0;
-    s.stack = (char*)malloc(STACK_MEMORY);
+VMScript *vm_load(VMContext *context, const char *data, int size)
+{
+    VMFormat format;
+    if (format_read(&format, data, size))
+        return NULL;
 
-    VMLink *links;
-    int link_size = 0;
-    int code_start = decode_header(data, &links, &link_size);
-    char *code = data + code_start;
+    VMScript *script = calloc(1, sizeof(VMScript));
+    const VMSection *code = &format.sections[VM_SECTION_CODE];
+    const VMSection *constants = &format.sections[VM_SECTION_CONSTANTS];
+    const VMSection *debug = &format.sections[VM_SECTION_DEBUG];
+    VMProgram *program = &script->program;
+    script->context = context;
+    script->last_start = -1;
+    script->entry = format.entry;
 
-    int running = 1;
-    while (running)
+    if (read_imports(context, script, &format.sections[VM_SECTION_IMPORTS]) ||
+        debug_decode(&script->debug, debug->data, debug->size) ||
+        program_decode(program, code->data, code->size, 
+            constants->data, constants->size))
     {
-        LOG("%i: ", s.pc);
+        free_script(script);
+        return NULL;
+    }
 
-        switch(code[s.pc++])
-        {
-            case BC_PUSH_1: 
-                LOG("push 1b %i\n", BYTE); 
-                s.stack[s.sp++] = code[s.pc++]; 
-                break;
-            
-            case BC_PUSH_4: 
-                LOG("push 4b %i\n", INT); 
-                memcpy(s.stack + s.sp, code + s.pc, 4);
-                s.sp += 4; s.pc += 4; 
-                break;
-            
-            case BC_PUSH_X:
-                LOG("push %ib\n", BYTE);
-                memcpy(s.stack + s.sp, code + s.pc + 1, BYTE);
-                s.sp += BYTE; s.pc += NBYTE;
-                break;
-            
-            case BC_POP:
-                LOG("pop %ib\n", BYTE);
-                s.sp -= code[s.pc++]; 
-                break;
-            
-            case BC_ALLOC:
-                LOG("alloc %ib\n", BYTE);
-                s.sp += code[s.pc++]; 
-                break;
-            
-            case BC_STORE_LOCAL_4:
-                LOG("store 4b at %i\n", BYTE);
-                memcpy(s.stack + s.bp + NBYTE, s.stack + s.sp - 4, 4); s.sp -= 4;
-                break;
+    // Everything the interpreter takes on trust is checked here once
+    if (verify_program(program, script->link_args, script->link_size) ||
+        read_exports(script, &format.sections[VM_SECTION_EXPORTS], 
+            format.version))
+    {
+        free_script(script);
+        return NULL;
+    }
 
-            case BC_STORE_LOCAL_X:
-            {
-                LOG("store %ib at %i\n", INT, code[s.pc + 4]);
-                int size = INT; s.pc += 4;
-                memcpy(s.stack + s.bp + NBYTE, s.stack + s.sp - size, size); s.sp -= size;
-                break;
-            }
+    if (script->entry != -1 && program_find(program, script->entry) == -1)
+    {
+        printf("Error: Invalid entry function %i\n", script->entry);
+        free_script(script);
+        return NULL;
+    }
 
-            case BC_LOAD_LOCAL_4:
-                LOG("load 4b at %i\n", BYTE);
-                memcpy(s.stack + s.sp, s.stack + s.bp + NBYTE, 4); s.sp += 4;
-                break;
+#if JIT_SUPPORTED
+    jit_init(&script->jit, program, script->links, script->link_async, 
+        &context->stack);
+#endif
 
-            case BC_LOAD_LOCAL_X:
-            {
-                LOG("load %ib at %i\n", INT, code[s.pc + 4]);
-                int size = INT; s.pc += 4;
-                memcpy(s.stack + s.sp, s.stack + s.bp + NBYTE, size); s.sp += size;
-                break;
-            }
+    // Either start everything off decoded and promote functions as they 
+    // get hot, or fuse and compile the whole program up front. Tiers 
+    // carry over between calls, so hot functions stay promoted
+#if VM_TIERED
+    tier_init(&script->tiers, program, JIT_SUPPORTED ? &script->jit : NULL, 
+        context->fuse_threshold, context->jit_threshold);
+#else
+#if JIT_SUPPORTED
+    jit_compile_all(&script->jit);
+#endif
+#if VM_FUSION
+    program_fuse(program, 0, program->size);
+#endif
+#endif
 
-            case BC_LOCAL_REF:
-            {
-                LOG("return ref of local at %ib\n", BYTE);
-                int loc = s.bp + NBYTE;
-                memcpy(s.stack + s.sp, &loc, 4); s.sp += 4;
-                break;
-            }
-
-            case BC_COPY:
-            {
-                LOG("copy %ib\n", BYTE);
-                int loc = *(int*)(s.stack + s.sp - 4); s.sp -= 4;
-                memcpy(s.stack + s.sp, s.stack + loc, BYTE);
-                s.sp += NBYTE;
-                break;
-            }
-            
-            case BC_GET_ARRAY_INDEX:
-            {
-                LOG("Get array (size %ib, element size %ib) element at index\n", INT, *(int*)(code + s.pc + 4));
-                int array_size = INT; s.pc += 4;
-                int element_size = INT; s.pc += 4;
-                int index = *(int*)(s.stack + s.sp - 4); s.sp -= 4;
-                memcpy(s.stack + s.sp - array_size, 
-                    s.stack + s.sp - array_size + element_size * index, 
-                    element_size);
-                s.sp -= array_size - element_size;
-                break;
-            }
-
-            case BC_GET_ATTR:
-            {
-                LOG("Get attr at %i of size %ib (type size %ib)\n", INT, *(int*)(code + s.pc + 4), *(int*)(code + s.pc + 8));
-                int offset = INT; s.pc += 4;
-                int size = INT; s.pc += 4;
-                int type_size = INT; s.pc += 4;
-                memcpy(s.stack + s.sp - type_size, s.stack + s.sp - type_size + offset, size);
-                s.sp -= type_size - size;
-                break;
-            }
-
-            case BC_ASSIGN_REF_X:
-            {
-                LOG("Assign ref %ib\n", INT);
-                int loc = *(int*)(s.stack + s.sp - 4); s.sp -= 4;
-                memcpy(s.stack + loc, s.stack + s.sp - INT, INT); s.sp -= INT;
-                s.pc += 4;
-                break;
-            }
-
-            case BC_CREATE_FRAME:
-                LOG("create stack frame of size %i\n", INT);
-                memcpy(s.stack + s.sp, &s.bp, 4); s.sp += 4;
-                s.bp = s.sp;
-                s.sp += INT;
-                s.pc += 4;
-                break;
-            
-            case BC_CALL:
-                LOG("call function at %i\n", INT);
-                memcpy(s.stack + s.sp, &s.pc, 4); s.sp += 4;
-                s.pc = INT;
-                s.depth++;
-                break;
-            
-            case BC_CALL_EXTERNAL:
-            {
-                LOG("call external function %i\n", INT);
-                int i;
-                for (i = 0; i < link_size; i++)
-                {
-                    if (links[i].id == INT)
-                    {
-                        links[i].func(&s);
-                        break;
-                    }
-                }
-                s.pc += 4;
-                break;
-            }
-            
-            case BC_RETURN:
-            {
-                LOG("Return size %i with arg size %i\n", BYTE, code[s.pc+1]);
-                int return_size = NBYTE;
-                int arg_size = NBYTE;
-                if (s.depth <= 0)
-                {
-                    memcpy(return_value, s.stack + s.sp - return_size, return_size);
-                    running = 0;
-                    break;
-                }
-
-                // Copy return value into correct slot
-                memcpy(s.stack + s.bp - 8 - arg_size - return_size, 
-                    s.stack + s.sp - return_size, return_size); 
-                s.sp -= return_size;
-
-                s.sp = s.bp;
-                memcpy(&s.bp, s.stack + s.sp - 4, 4); s.sp -= 4;
-                memcpy(&s.pc, s.stack + s.sp - 4, 4); s.sp -= 4;
-                s.sp -= arg_size;
-                s.pc += 4;
-                s.depth--;
-                break;
-            }
+    if (context->counts.running)
+        counts_reserve(&context->counts, context->external_size);
+    return script;
+}
 
-            case BC_JUMP:
-                LOG("Jump to %i\n", INT);
-                s.pc = INT;
-                break;
+void vm_unload(VMScript *script)
+{
+    VMContext *context = script->context;
+    if (context->suspended == script)
+        context->suspended = NULL;
+    if (context->run_script == script)
+        context->run_script = NULL;
 
-            case BC_JUMP_IF_NOT:
-                LOG("Jump if not %s to %i\n", s.stack[s.sp-1] ? "true" : "false", INT);
-                if (!s.stack[--s.sp])
-                    s.pc = INT;
-                else
-                    s.pc += 4;
-                break;
+#if VM_TIERED
+    tier_report(&script->tiers, &script->context->tier_stats);
+    tier_free(&script->tiers);
+#endif
 
-            OPERATION_SET(INT_INT, int, int, int)
-            OPERATION_SET(INT_FLOAT, int, float, float)
-            OPERATION_SET(INT_CHAR, int, char, int)
-            OPERATION_SET(FLOAT_INT, float, int, float)
-            OPERATION_SET(FLOAT_FLOAT, float, float, float)
-            OPERATION_SET(FLOAT_CHAR, float, char, float)
-            OPERATION_SET(CHAR_INT, char, int, int)
-            OPERATION_SET(CHAR_FLOAT, char, float, float)
-            OPERATION_SET(CHAR_CHAR, char, char, char)
-            CAST_SET(INT, int)
-            CAST_SET(FLOAT, float)
-            CAST_SET(CHAR, char)
-            CAST_SET(BOOL, char)
-
-            default: 
-                printf("Error: Unkown bytecode %i\n", code[s.pc-1]); 
-                running = 0;
-        }
+#if JIT_SUPPORTED
+    jit_free(&script->jit);
+#endif
 
-#if DEBUG_STACK
-        int i;
-        printf("Stack: ");
-        for (i = 0; i < s.sp; i++)
-            printf("%i ", s.stack[i]);
-        printf("\n");
+    free_script(script);
+}
+
+const VMFunction *vm_get_function(const VMScript *script, 
+    const char *name)
+{
+    if (script->export_table == NULL)
+        return NULL;
+
+    unsigned int slot = hash_name(name);
+    for (;; slot++)
+    {
+        int index = script->export_table[slot & script->export_mask];
+        if (index == 0)
+            return NULL;
+        if (!strcmp(script->exports[index - 1].name, name))
+            return &script->exports[index - 1];
+    }
+}
+
+int vm_find_function(const VMScript *script, const char *name)
+{
+    const VMFunction *function = vm_get_function(script, name);
+    return function != NULL ? function->offset : -1;
+}
+
+int vm_entry(const VMScript *script)
+{
+    return script->entry;
+}
+
+int vm_find_source(const VMScript *script, int offset, 
+    VMSourcePosition *position)
+{
+    const VMDebug *debug = &script->debug;
+    const VMDebugFunction *function = debug_find_function(debug, offset);
+    const VMDebugLine *line = debug_find_line(debug, offset);
+    if (function == NULL || line == NULL)
+        return -1;
+
+    position->function = function->name;
+    position->file = debug->files[line->file];
+    position->line = line->line;
+    position->column = line->column;
+    return 0;
+}
+
+// Follows an error message with where it happened, if that's known
+static void print_source(const VMScript *script, int offset)
+{
+    VMSourcePosition position;
+    if (offset != -1 && vm_find_source(script, offset, &position) == 0)
+    {
+        printf("    in %s at %s:%i:%i\n", position.function, 
+            position.file, position.line, position.column);
+    }
+}
+
+// The newest frame was made by the call just before the instruction it 
+// returns to, gives its offset or -1 if there isn't one
+static int newest_call(const VMScript *script)
+{
+    const VMStack *stack = &script->context->stack;
+    const VMProgram *program = &script->program;
+    int return_index;
+
+    if (stack->frame < 8 || stack->frame > stack->size)
+        return -1;
+    memcpy(&return_index, stack->memory + stack->frame - 8, 4);
+    if (return_index < 1 || return_index > program->size ||
+        program->code[return_index - 1].op != BC_CALL)
+    {
+        return -1;
+    }
+
+    return program->offsets[return_index - 1];
+}
+
+// A context's stack is taken while it has a suspended call
+static int is_suspended(const VMContext *context)
+{
+    if (context->suspended == NULL)
+        return 0;
+
+    printf("Error: The context has a suspended call\n");
+    return 1;
+}
+
+static void finish_run(VMContext *context)
+{
+    vm_unload(context->run_script);
+    context->run_script = NULL;
+
+    if (context->counts.running && context->counts_path != NULL)
+        vm_counts_write(context, context->counts_path);
+}
+
+int vm_map(VMContext *context, void *data, int size)
+{
+    int ref = stack_map(&context->stack, data, size);
+    if (ref == -1)
+        printf("Error: No room to map %i bytes\n", size);
+    return ref;
+}
+
+void vm_unmap(VMContext *context, int ref)
+{
+    if (stack_unmap(&context->stack, ref))
+        printf("Error: Nothing is mapped at ref %i\n", ref);
+}
+
+void *vm_ref(const VMState *state, int ref, int size)
+{
+    const VMStack *stack = state->address_space;
+    if (ref >= 0 && size >= 0 && ref <= stack->size - size)
+        return stack->memory + ref;
+    if (ref >= stack->heap && size >= 0 && ref <= stack->heap_top - size)
+        return stack->memory + ref;
+    if (ref >= stack->mapped_size)
+        return stack_view(stack, ref, size);
+    return NULL;
+}
+
+int vm_run(VMContext *context, const char *data, int size, 
+    int start, char *return_value)
+{
+    if (is_suspended(context))
+        return -1;
+
+    VMScript *script = vm_load(context, data, size);
+    if (script == NULL)
+        return -1;
+
+    // A suspended call keeps its script until it's resumed to the end
+    context->run_script = script;
+    int result = vm_call(script, start, return_value);
+    if (result != VM_PENDING && result != VM_YIELDED)
+        finish_run(context);
+    return result;
+}
+
+// Each column holds one param, the first at the end as if the compiler 
+// had pushed them
+static void batch_load(VMScript *script)
+{
+    const VMBatch *batch = &script->batch;
+    char *at = script->context->stack.memory + script->last_return_size + 
+        script->last_arg_size;
+    int i;
+
+    // Copies of a known size are inlined, rather than calling memcpy
+    for (i = 0; i < batch->column_count; i++)
+    {
+        int size = batch->columns[i].size;
+        const char *value = (const char*)batch->columns[i].data + 
+            batch->row * size;
+        at -= size;
+        if (size == 4)
+            memcpy(at, value, 4);
+        else if (size == 1)
+            *at = *value;
+        else
+            memcpy(at, value, size);
+    }
+}
+
+// Once a row has returned, load the next one and move the return value 
+// on to its result. Gives 0 when there's no batch or it's finished
+static int batch_next(VMScript *script, char **return_value)
+{
+    VMBatch *batch = &script->batch;
+    if (batch->row_count == 0)
+        return 0;
+    if (batch->row >= batch->row_count - 1)
+    {
+        batch->row = batch->row_count;
+        return 0;
+    }
+
+    // Each row is a call of its own, so gets a fresh heap
+    batch->row += 1;
+    batch_load(script);
+    stack_free_heap(&script->context->stack);
+    if (*return_value != NULL)
+        *return_value += script->last_return_size;
+
+#if VM_TIERED
+    VMTiers *tiers = &script->tiers;
+    int start = script->last_start;
+    if (++tiers->calls[start] + tiers->back_edges[start] >= tiers->next[start])
+        tier_promote(tiers, start);
 #endif
+    return 1;
+}
+
+// The fast loop has no profiling, counting or budget hooks at all. The 
+// profiled one keeps the instruction it's on where the sampler can see 
+// it, and clears it while native code runs. The budgeted one charges 
+// fuel for calls and back-edges, and checks each frame against the stack 
+// limit before it's made. The counting one never runs native code, so 
+// every opcode a call runs goes through it and is counted, and it 
+// charges budgets too
+#define CHARGE_CALL(in)
+#define CHARGE_BACK_EDGE(in)
+#define INTERPRET interpret
+#define PROFILE_IP()
+#define PROFILE_NATIVE()
+#define COUNT_OP()
+#define COUNT_EXTERNAL()
+#define RUN_NATIVE 1
+#define HAS_BUDGET 0
+#include "interpret.h"
+#undef INTERPRET
+#undef PROFILE_IP
+#undef PROFILE_NATIVE
+
+#if PROFILE_SUPPORTED
+#define INTERPRET interpret_profiled
+#define PROFILE_IP() context->profile.ip = in
+#define PROFILE_NATIVE() context->profile.ip = NULL
+#include "interpret.h"
+#undef INTERPRET
+#undef PROFILE_IP
+#undef PROFILE_NATIVE
+#endif
+
+#undef COUNT_OP
+#undef COUNT_EXTERNAL
+#undef RUN_NATIVE
+#undef CHARGE_CALL
+#undef CHARGE_BACK_EDGE
+#undef HAS_BUDGET
+
+// A call out of fuel stops before the call, so resuming makes it
+#define CHARGE_CALL(in) \
+    if (--fuel < 0 || sp + 8 + code[(in)->a].b > stack_limit) \
+    { \
+        ip = code + ((in) - code); \
+        goto out_of_budget; \
     }
+#define CHARGE_BACK_EDGE(in) \
+    if ((in)->a <= (in) - code && --fuel < 0) \
+        goto out_of_budget;
+#define HAS_BUDGET 1
+
+#define INTERPRET interpret_budgeted
+#define PROFILE_IP()
+#define PROFILE_NATIVE()
+#define COUNT_OP()
+#define COUNT_EXTERNAL()
+#define RUN_NATIVE 0
+#include "interpret.h"
+#undef INTERPRET
+#undef PROFILE_IP
+#undef PROFILE_NATIVE
+#undef COUNT_OP
+#undef COUNT_EXTERNAL
+#undef RUN_NATIVE
 
-    free(s.stack);
-    free(links);
+#define INTERPRET interpret_counted
+#define PROFILE_IP()
+#define PROFILE_NATIVE()
+#define COUNT_OP() counts_op(&context->counts, in->op)
+#define COUNT_EXTERNAL() \
+    context->counts.externals[script->link_ids[in->a]] += 1
+#define RUN_NATIVE 0
+#include "interpret.h"
+#undef INTERPRET
+#undef PROFILE_IP
+#undef PROFILE_NATIVE
+#undef COUNT_OP
+#undef COUNT_EXTERNAL
+#undef RUN_NATIVE
+#undef CHARGE_CALL
+#undef CHARGE_BACK_EDGE
+#undef HAS_BUDGET
+
+// Runs a call from the top, or from where it was suspended, in whichever 
+// loop the context needs
+static int run_call(VMScript *script, int start_index, 
+    const VMState *resume, char *return_value)
+{
+    VMContext *context = script->context;
+    VMProgram *program = &script->program;
+    int result;
+
+    if (context->counts.running)
+    {
+        if (resume == NULL)
+            counts_enter(&context->counts);
+        result = interpret_counted(script, start_index, resume, return_value);
+    }
+    else if (context->fuel > 0 || context->stack_limit > 0)
+    {
+        result = interpret_budgeted(script, start_index, resume, return_value);
+    }
+#if PROFILE_SUPPORTED
+    else if (context->profile.running)
+    {
+        profile_enter(&context->profile, program, &context->stack, start_index);
+        result = interpret_profiled(script, start_index, resume, return_value);
+        profile_leave(&context->profile);
+    }
+#endif
+    else
+    {
+        result = interpret(script, start_index, resume, return_value);
+    }
+
+    if (result == VM_PENDING || result == VM_YIELDED)
+    {
+        context->suspended = script;
+        context->resume_start = start_index;
+    }
+    else
+    {
+        // Everything the call allocated goes with it
+        stack_free_heap(&context->stack);
+    }
+    return result;
+}
+
+// Starts a call from the top, once its args are on the stack
+static int start_call(VMScript *script, int start_index, char *return_value)
+{
+    VMContext *context = script->context;
+    VMProgram *program = &script->program;
+
+    // Later frames are checked as they're made, but the entry function's 
+    // is made before the loop starts
+    int frame_end = script->last_return_size + script->last_arg_size + 8 + 
+        program->code[start_index].b;
+    if (context->stack_limit > 0 && frame_end > context->stack_limit)
+    {
+        printf("Error: Stack limit of %i bytes reached at call depth 0\n", 
+            context->stack_limit);
+        return -1;
+    }
+
+#if VM_TIERED
+    script->tiers.calls[start_index] += 1;
+    tier_promote(&script->tiers, start_index);
+#endif
+
+    return run_call(script, start_index, NULL, return_value);
+}
+
+int vm_call(VMScript *script, int start, char *return_value)
+{
+    VMProgram *program = &script->program;
+    if (is_suspended(script->context))
+        return -1;
+
+    int start_index = program_find(program, start);
+    if (start_index == -1)
+    {
+        printf("Error: Invalid start location %i\n", start);
+        return -1;
+    }
+
+    if (start_index != script->last_start)
+    {
+        script->last_start = start_index;
+        function_sizes(program, start_index, 
+            &script->last_return_size, &script->last_arg_size);
+    }
+
+    if (script->last_arg_size > 0)
+    {
+        printf("Error: The function at %i takes args, which need vm_invoke\n", 
+            start);
+        return -1;
+    }
+
+    return start_call(script, start_index, return_value);
+}
+
+int vm_begin_call(VMScript *script, const VMFunction *function)
+{
+    script->call = NULL;
+    if (function == NULL)
+    {
+        printf("Error: There's no function to call\n");
+        return -1;
+    }
+
+    if (is_suspended(script->context))
+        return -1;
+
+    script->call = function;
+    script->arg_space = function->arg_size;
     return 0;
 }
+
+// Args are written from the top of their space down, so the first is 
+// nearest the frame as if the compiler had pushed them in reverse
+void vm_push_data(VMScript *script, const void *data, int size)
+{
+    if (script->call == NULL || size > script->arg_space)
+    {
+        script->arg_space = -1;
+        return;
+    }
+
+    script->arg_space -= size;
+    memcpy(script->context->stack.memory + script->call->return_size + 
+        script->arg_space, data, size);
+}
+
+char *vm_arg_data(VMScript *script)
+{
+    if (script->call == NULL || script->arg_space != script->call->arg_size)
+        return NULL;
+
+    script->arg_space = 0;
+    return script->context->stack.memory + script->call->return_size;
+}
+
+void vm_push_int(VMScript *script, int value)
+{
+    vm_push_data(script, &value, sizeof(int));
+}
+
+void vm_push_float(VMScript *script, float value)
+{
+    vm_push_data(script, &value, sizeof(float));
+}
+
+void vm_push_char(VMScript *script, char value)
+{
+    vm_push_data(script, &value, sizeof(char));
+}
+
+void vm_push_bool(VMScript *script, int value)
+{
+    vm_push_char(script, value != 0);
+}
+
+int vm_invoke(VMScript *script, char *return_value)
+{
+    const VMFunction *function = script->call;
+    script->call = NULL;
+    if (function == NULL)
+    {
+        printf("Error: No call was begun to invoke\n");
+        return -1;
+    }
+
+    if (script->arg_space != 0)
+    {
+        printf("Error: Args given to '%s' don't add up to its %i bytes\n", 
+            function->name, function->arg_size);
+        return -1;
+    }
+
+    script->last_start = function->start_index;
+    script->last_return_size = function->return_size;
+    script->last_arg_size = function->arg_size;
+    return start_call(script, function->start_index, return_value);
+}
+
+int vm_call_batch(VMScript *script, const VMFunction *function, 
+    const VMColumn *columns, int column_count, int row_count, 
+    char *results)
+{
+    VMBatch *batch = &script->batch;
+    int i, arg_size = 0;
+    if (function == NULL)
+    {
+        printf("Error: There's no function to call\n");
+        return -1;
+    }
+
+    if (is_suspended(script->context))
+        return -1;
+
+    for (i = 0; i < column_count; i++)
+    {
+        if (columns[i].data == NULL || columns[i].size <= 0)
+            break;
+        arg_size += columns[i].size;
+    }
+
+    if (i < column_count || arg_size != function->arg_size)
+    {
+        printf("Error: Columns given to '%s' don't add up to its %i "
+            "bytes of args\n", function->name, function->arg_size);
+        return -1;
+    }
+
+    batch->row = 0;
+    batch->row_count = 0;
+    if (row_count <= 0)
+        return VM_DONE;
+
+    // Only the data has to outlive the call, the list of columns is kept
+    if (column_count > batch->column_capacity)
+    {
+        free(batch->columns);
+        batch->columns = malloc(column_count * sizeof(VMColumn));
+        batch->column_capacity = column_count;
+    }
+
+    memcpy(batch->columns, columns, column_count * sizeof(VMColumn));
+    batch->column_count = column_count;
+    batch->results = results;
+    batch->row_count = row_count;
+    script->call = NULL;
+    script->last_start = function->start_index;
+    script->last_return_size = function->return_size;
+    script->last_arg_size = function->arg_size;
+    batch_load(script);
+
+    int result = start_call(script, function->start_index, results);
+    if (result != VM_PENDING && result != VM_YIELDED)
+        batch->row_count = 0;
+    return result;
+}
+
+int vm_batch_row(const VMScript *script)
+{
+    return script->batch.row;
+}
+
+int vm_resume(VMContext *context, char *return_value)
+{
+    VMScript *script = context->suspended;
+    if (script == NULL)
+    {
+        printf("Error: There's no suspended call to resume\n");
+        return -1;
+    }
+
+    // A batch's results go where its rows say
+    VMBatch *batch = &script->batch;
+    if (batch->row_count > 0)
+    {
+        return_value = batch->results == NULL ? NULL : 
+            batch->results + batch->row * script->last_return_size;
+    }
+
+    context->suspended = NULL;
+    int result = run_call(script, context->resume_start, 
+        &context->resume, return_value);
+    if (result != VM_PENDING && result != VM_YIELDED)
+    {
+        batch->row_count = 0;
+        if (script == context->run_script)
+            finish_run(context);
+    }
+    return result;
+}